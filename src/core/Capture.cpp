@@ -0,0 +1,111 @@
+/**
+ * @file Capture.cpp
+ * @brief Implements the session captures
+ * @author Noak Palander
+ * @version 1.0
+ * @see Capture.hpp
+ */
+
+#include "Capture.hpp"
+
+#include "Session.hpp"
+#include "Wire.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace Chat {
+    namespace {
+        constexpr std::array<char, 8> Magic = { 'C', 'H', 'A', 'T', 'C', 'A', 'P', '2' };
+        constexpr std::size_t HeaderSize = Magic.size() + sizeof(std::int64_t);
+        constexpr std::size_t RecordSize = sizeof(std::int64_t) + sizeof(std::uint32_t) + 1;
+
+        // Captures are written in large blocks, a record costs a memcpy on the io thread
+        constexpr std::size_t BufferSize = 1024 * 1024;
+    }
+
+    Capture::Capture(std::filesystem::path const& path)
+        :   started_{std::chrono::steady_clock::now()}
+    {
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_)
+            throw std::system_error(errno, std::generic_category(), path.string());
+
+        std::setvbuf(file_, nullptr, _IOFBF, BufferSize);
+
+        std::array<std::byte, HeaderSize> header{};
+        auto const wallClock = static_cast<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+
+        std::memcpy(header.data(), Magic.data(), Magic.size());
+        Wire::Store(header.data() + Magic.size(), wallClock);
+        std::fwrite(header.data(), 1, header.size(), file_);
+    }
+
+    Capture::~Capture() {
+        std::fclose(file_);
+    }
+
+    void Capture::Record(Direction direction, std::uint32_t session, std::span<std::byte const> packet) {
+        std::array<std::byte, RecordSize> record{};
+        auto const elapsed = static_cast<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started_).count());
+
+        Wire::Store(record.data(), elapsed);
+        Wire::Store(record.data() + sizeof(elapsed), session);
+        record.back() = static_cast<std::byte>(direction);
+
+        std::fwrite(record.data(), 1, record.size(), file_);
+        std::fwrite(packet.data(), 1, packet.size(), file_);
+    }
+
+    CaptureReader::CaptureReader(std::filesystem::path const& path) {
+        file_ = std::fopen(path.c_str(), "rb");
+        if (!file_)
+            throw std::system_error(errno, std::generic_category(), path.string());
+
+        std::array<std::byte, HeaderSize> header{};
+        if (std::fread(header.data(), 1, header.size(), file_) != header.size() ||
+            std::memcmp(header.data(), Magic.data(), Magic.size()) != 0) {
+            std::fclose(file_);
+            throw std::runtime_error(path.string() + " isn't a capture");
+        }
+
+        auto const wallClock = Wire::Load<std::int64_t>(header.data() + Magic.size());
+        started_ = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(wallClock)));
+    }
+
+    CaptureReader::~CaptureReader() {
+        std::fclose(file_);
+    }
+
+    bool CaptureReader::Next(CapturedFrame& frame) {
+        std::array<std::byte, RecordSize + sizeof(std::uint32_t)> record{};
+        if (std::fread(record.data(), 1, record.size(), file_) != record.size())
+            return false;
+
+        auto const elapsed = Wire::Load<std::int64_t>(record.data());
+        auto const length = Wire::Load<std::uint32_t>(record.data() + RecordSize);
+        frame.session = Wire::Load<std::uint32_t>(record.data() + sizeof(elapsed));
+
+        auto const direction = static_cast<unsigned char>(record[RecordSize - 1]);
+        if (direction > static_cast<unsigned char>(Direction::Sent) || length == 0 || length > Session::MaxPacket)
+            return false;
+
+        frame.elapsed = std::chrono::nanoseconds(elapsed);
+        frame.direction = static_cast<Direction>(direction);
+
+        // The length prefix is kept, packets are handed around with it
+        frame.packet.resize(sizeof(std::uint32_t) + length);
+        std::copy_n(record.data() + RecordSize, sizeof(length), frame.packet.data());
+        return std::fread(frame.packet.data() + sizeof(std::uint32_t), 1, length, file_) == length;
+    }
+
+    void CaptureReader::Rewind() {
+        std::fseek(file_, static_cast<long>(HeaderSize), SEEK_SET);
+    }
+}
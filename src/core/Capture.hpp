@@ -0,0 +1,123 @@
+/**
+ * @file Capture.hpp
+ * @brief Contains the recording and reading of session captures, every frame sent and received with a timestamp
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * A capture starts with a header: 8B = magic "CHATCAP2", 8B = wall clock at the start, in nanoseconds since the epoch.
+ * It's followed by one record per frame: 8B = nanoseconds since the start, 4B = session ID, 1B = direction,
+ * followed by the frame itself, including its length prefix. Integers are little-endian, like on the wire.
+ */
+
+#ifndef CHATAPP_CAPTURE_HPP
+#define CHATAPP_CAPTURE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @enum Chat::Direction
+     * @brief Whether a captured frame was received from or sent to the peer
+     * @author Noak Palander
+     */
+    enum class Direction : unsigned char {
+        Received = 0,
+        Sent = 1
+    };
+
+    /**
+     * @struct Chat::CapturedFrame
+     * @brief A single frame read from a capture
+     * @author Noak Palander
+     */
+    struct CapturedFrame {
+        std::chrono::nanoseconds elapsed;   /**< Since the capture was started */
+        std::uint32_t session;
+        Direction direction;
+        std::vector<std::byte> packet;      /**< The frame, including its length prefix */
+    };
+
+    /**
+     * @class Chat::Capture
+     * @brief Records frames to a compact binary file, must only be used from the io thread
+     * @author Noak Palander
+     */
+    class Capture {
+    public:
+        /**
+         * @brief Creates or truncates a capture file
+         * @param path the file to record to
+         * @throws std::system_error if the file can't be created
+         */
+        explicit Capture(std::filesystem::path const& path);
+
+        Capture(Capture const&) = delete;
+        Capture& operator=(Capture const&) = delete;
+
+        /**
+         * @brief Flushes and closes the file
+         */
+        ~Capture();
+
+        /**
+         * @brief Records a frame, write errors are ignored as a capture must never break the connection
+         * @param direction whether it was received or sent
+         * @param session the session it was received or sent on
+         * @param packet the frame, including its length prefix
+         */
+        void Record(Direction direction, std::uint32_t session, std::span<std::byte const> packet);
+
+    private:
+        std::FILE* file_ = nullptr;
+        std::chrono::steady_clock::time_point started_;
+    };
+
+    /**
+     * @class Chat::CaptureReader
+     * @brief Reads the frames of a capture in the order they were recorded
+     * @author Noak Palander
+     */
+    class CaptureReader {
+    public:
+        /**
+         * @brief Opens a capture file
+         * @param path the file to read
+         * @throws std::system_error if the file can't be opened
+         * @throws std::runtime_error if it isn't a capture
+         */
+        explicit CaptureReader(std::filesystem::path const& path);
+
+        CaptureReader(CaptureReader const&) = delete;
+        CaptureReader& operator=(CaptureReader const&) = delete;
+
+        ~CaptureReader();
+
+        /**
+         * @brief Reads the next frame, the packet buffer of the frame is reused
+         * @param frame the frame to read into
+         * @return false at the end of the capture, or if the rest of it is truncated or corrupted
+         */
+        bool Next(CapturedFrame& frame);
+
+        /**
+         * @return the wall clock at the start of the capture
+         */
+        [[nodiscard]] std::chrono::system_clock::time_point Started() const noexcept { return started_; }
+
+        /**
+         * @brief Starts reading from the first frame again
+         */
+        void Rewind();
+
+    private:
+        std::FILE* file_ = nullptr;
+        std::chrono::system_clock::time_point started_;
+    };
+}
+
+#endif // CHATAPP_CAPTURE_HPP
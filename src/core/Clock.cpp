@@ -0,0 +1,152 @@
+/**
+ * @file Clock.cpp
+ * @brief Implements the peer clock estimation
+ * @author Noak Palander
+ * @version 1.0
+ * @see Clock.hpp
+ */
+
+#include "Clock.hpp"
+
+#include "Wire.hpp"
+#include <algorithm>
+
+namespace Chat {
+    namespace {
+        constexpr std::size_t ProbeSize = sizeof(std::uint32_t) + 1 + sizeof(std::int64_t);
+
+        std::int64_t Nanoseconds(std::chrono::system_clock::time_point time) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+        }
+
+        std::chrono::system_clock::time_point TimePoint(std::int64_t nanoseconds) {
+            return std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(nanoseconds)));
+        }
+    }
+
+    void PeerClock::Add(ClockSample const& sample) {
+        auto const roundTrip = sample.RoundTrip();
+
+        // Our clock was stepped during the exchange, the sample says nothing
+        if (roundTrip.count() < 0)
+            return;
+
+        window_[samples_ % Window] = Point{
+            .at = sample.sent + (sample.returned - sample.sent) / 2,
+            .offset = sample.Offset(),
+            .roundTrip = roundTrip
+        };
+        ++samples_;
+
+        // The least queued sample of the window is the most accurate one
+        auto const end = window_.begin() + static_cast<std::ptrdiff_t>(std::min(samples_, Window));
+        auto const best = *std::min_element(window_.begin(), end, [](Point const& lhs, Point const& rhs) {
+            return lhs.roundTrip < rhs.roundTrip;
+        });
+
+        if (best_ && best_->at == best.at)
+            return;
+
+        best_ = best;
+        history_.push_back(best);
+        if (history_.size() > History)
+            history_.erase(history_.begin());
+
+        Fit();
+    }
+
+    void PeerClock::Fit() {
+        if (history_.size() < 2 || history_.back().at - history_.front().at < DriftSpan)
+            return;
+
+        // Least squares slope of offset over time, relative to the oldest point to keep the doubles precise
+        auto const origin = history_.front().at;
+        double sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumXY = 0.0;
+
+        for (auto const& point : history_) {
+            auto const x = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(point.at - origin).count());
+            auto const y = static_cast<double>(point.offset.count());
+            sumX += x;
+            sumY += y;
+            sumXX += x * x;
+            sumXY += x * y;
+        }
+
+        auto const n = static_cast<double>(history_.size());
+        double const denominator = n * sumXX - sumX * sumX;
+        if (denominator > 0.0)
+            drift_ = std::clamp((n * sumXY - sumX * sumY) / denominator, -MaxDrift / 1e6, MaxDrift / 1e6);
+    }
+
+    std::chrono::nanoseconds PeerClock::OffsetAt(std::chrono::system_clock::time_point at) const {
+        auto const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(at - best_->at);
+        return best_->offset + std::chrono::nanoseconds(static_cast<std::int64_t>(drift_ * static_cast<double>(elapsed.count())));
+    }
+
+    std::optional<ClockEstimate> PeerClock::Estimate(std::uint32_t session) const {
+        if (!best_)
+            return std::nullopt;
+
+        return ClockEstimate{
+            .session = session,
+            .offset = OffsetAt(std::chrono::system_clock::now()),
+            .drift = drift_ * 1e6,
+            .roundTrip = best_->roundTrip,
+            .samples = samples_
+        };
+    }
+
+    std::chrono::system_clock::time_point PeerClock::ToLocal(std::chrono::system_clock::time_point peer) const {
+        if (!best_)
+            return peer;
+
+        // The offset is extrapolated to the instant in our clock, the peer's own timestamp is close enough for that
+        return peer - std::chrono::duration_cast<std::chrono::system_clock::duration>(OffsetAt(peer));
+    }
+
+    Packet ClockProbe() {
+        std::vector<std::byte> packet(ProbeSize);
+        std::uint32_t const length = ProbeSize - sizeof(std::uint32_t);
+        std::int64_t const sent = Nanoseconds(std::chrono::system_clock::now());
+
+        Wire::Store(packet.data(), length);
+        Wire::Store(packet.data() + sizeof(std::uint32_t), MessageType::ClockProbe);
+        Wire::Store(packet.data() + sizeof(std::uint32_t) + 1, sent);
+        return std::make_shared<std::vector<std::byte> const>(std::move(packet));
+    }
+
+    Packet ClockReply(std::span<std::byte const> probe, std::chrono::system_clock::time_point received) {
+        if (probe.size() != ProbeSize)
+            return nullptr;
+
+        std::vector<std::byte> packet(ClockReplySize);
+        std::byte* ptr = packet.data();
+        std::uint32_t const length = ClockReplySize - sizeof(std::uint32_t);
+
+        Wire::Store(ptr, length);
+        ptr += sizeof(length);
+        Wire::Store(ptr++, MessageType::ClockReply);
+
+        // t1 is echoed back untouched, it's already in the wire byte order
+        std::copy_n(probe.data() + sizeof(std::uint32_t) + 1, sizeof(std::int64_t), ptr);
+        ptr += sizeof(std::int64_t);
+        Wire::Store(ptr, Nanoseconds(received));
+        Wire::Store(ptr + sizeof(std::int64_t), Nanoseconds(std::chrono::system_clock::now()));
+        return std::make_shared<std::vector<std::byte> const>(std::move(packet));
+    }
+
+    std::optional<ClockSample> DecodeClockReply(std::span<std::byte const> reply, std::chrono::system_clock::time_point returned) {
+        if (reply.size() != ClockReplySize)
+            return std::nullopt;
+
+        std::byte const* stamps = reply.data() + sizeof(std::uint32_t) + 1;
+
+        return ClockSample{
+            .sent = TimePoint(Wire::Load<std::int64_t>(stamps)),
+            .received = TimePoint(Wire::Load<std::int64_t>(stamps + sizeof(std::int64_t))),
+            .replied = TimePoint(Wire::Load<std::int64_t>(stamps + sizeof(std::int64_t) * 2)),
+            .returned = returned
+        };
+    }
+}
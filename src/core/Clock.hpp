@@ -0,0 +1,165 @@
+/**
+ * @file Clock.hpp
+ * @brief Contains the NTP-style estimation of a peer's clock offset and drift, used to correct one-way latencies
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * Both ends probe each other, every timestamp is the sender's system_clock in nanoseconds since the epoch:
+ * Probe: 4B = length, 1B = type (ClockProbe), 8B = t1, when the probe was sent
+ * Reply: 4B = length, 1B = type (ClockReply), 8B = t1, 8B = t2, when the probe was received, 8B = t3, when the reply was sent
+ * The prober stamps t4 once the reply is received.
+ */
+
+#ifndef CHATAPP_CLOCK_HPP
+#define CHATAPP_CLOCK_HPP
+
+#include "Message.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @brief The size of a clock reply including the length prefix, every reply has exactly this size
+     */
+    inline constexpr std::size_t ClockReplySize = sizeof(std::uint32_t) + 1 + sizeof(std::int64_t) * 3;
+
+    /**
+     * @struct Chat::ClockSample
+     * @brief A single probe exchange, t1 and t4 are in our clock while t2 and t3 are in the peer's
+     * @author Noak Palander
+     */
+    struct ClockSample {
+        std::chrono::system_clock::time_point sent;       /**< t1 */
+        std::chrono::system_clock::time_point received;   /**< t2 */
+        std::chrono::system_clock::time_point replied;    /**< t3 */
+        std::chrono::system_clock::time_point returned;   /**< t4 */
+
+        /**
+         * @return how far the peer's clock is ahead of ours
+         */
+        [[nodiscard]] std::chrono::nanoseconds Offset() const noexcept { return ((received - sent) + (replied - returned)) / 2; }
+
+        /**
+         * @return the round trip, excluding the time the peer held the probe
+         */
+        [[nodiscard]] std::chrono::nanoseconds RoundTrip() const noexcept { return (returned - sent) - (replied - received); }
+    };
+
+    /**
+     * @struct Chat::ClockEstimate
+     * @brief The current estimate of a peer's clock
+     * @author Noak Palander
+     */
+    struct ClockEstimate {
+        std::uint32_t session;
+        std::chrono::nanoseconds offset;      /**< How far the peer's clock is ahead of ours, now */
+        double drift;                         /**< How fast the offset changes, in parts per million */
+        std::chrono::nanoseconds roundTrip;   /**< The smallest round trip in the current window */
+        std::size_t samples;                  /**< Probe exchanges seen so far */
+    };
+
+    /**
+     * @class Chat::PeerClock
+     * @brief Estimates a peer's clock offset from the minimum round trip samples, and its drift from how that offset moves
+     * @author Noak Palander
+     *
+     * The sample with the smallest round trip in the window had the least queueing, so its offset is the most accurate.
+     * Every new best sample is kept in a history, and the drift is the least squares slope of the offsets in it.
+     */
+    class PeerClock {
+    public:
+        /**
+         * @brief The number of recent samples the best one is picked from
+         */
+        static constexpr std::size_t Window = 8;
+
+        /**
+         * @brief The number of best samples the drift is fitted to
+         */
+        static constexpr std::size_t History = 32;
+
+        /**
+         * @brief The shortest history the drift is fitted to, over shorter spans the round trip jitter dominates the slope
+         */
+        static constexpr std::chrono::seconds DriftSpan{30};
+
+        /**
+         * @brief The largest drift believed, in parts per million, quartz oscillators stay well within it
+         */
+        static constexpr double MaxDrift = 500.0;
+
+        /**
+         * @brief Adds a probe exchange
+         * @param sample the completed exchange
+         */
+        void Add(ClockSample const& sample);
+
+        /**
+         * @param session the identifier to report the estimate under
+         * @return the current estimate, or nothing if no probe has completed yet
+         */
+        [[nodiscard]] std::optional<ClockEstimate> Estimate(std::uint32_t session) const;
+
+        /**
+         * @brief Converts a timestamp stamped by the peer into our clock, it's returned as-is before the first sample
+         * @param peer the peer's timestamp
+         * @return the same instant in our clock
+         */
+        [[nodiscard]] std::chrono::system_clock::time_point ToLocal(std::chrono::system_clock::time_point peer) const;
+
+        /**
+         * @return true once the window is full, until then every reply is followed by another probe
+         */
+        [[nodiscard]] bool Settled() const noexcept { return samples_ >= Window; }
+
+    private:
+        struct Point {
+            std::chrono::system_clock::time_point at;   /**< The midpoint of the exchange, in our clock */
+            std::chrono::nanoseconds offset;
+            std::chrono::nanoseconds roundTrip;
+        };
+
+        /**
+         * @brief Internal, fits the drift to the history
+         */
+        void Fit();
+
+        /**
+         * @return the offset extrapolated to a point in time, in our clock
+         */
+        [[nodiscard]] std::chrono::nanoseconds OffsetAt(std::chrono::system_clock::time_point at) const;
+
+        std::array<Point, Window> window_{};
+        std::vector<Point> history_;
+        std::optional<Point> best_;
+        std::size_t samples_ = 0;
+        double drift_ = 0.0;            /**< Nanoseconds of offset per nanosecond */
+    };
+
+    /**
+     * @return a probe stamped with the current time
+     */
+    [[nodiscard]] Packet ClockProbe();
+
+    /**
+     * @brief Answers a probe
+     * @param probe the received probe
+     * @param received when the probe was received
+     * @return the reply, or null if the probe is malformed
+     */
+    [[nodiscard]] Packet ClockReply(std::span<std::byte const> probe, std::chrono::system_clock::time_point received);
+
+    /**
+     * @brief Decodes a reply to one of our probes
+     * @param reply the received reply
+     * @param returned when the reply was received
+     * @return the completed exchange, or nothing if the reply is malformed
+     */
+    [[nodiscard]] std::optional<ClockSample> DecodeClockReply(std::span<std::byte const> reply, std::chrono::system_clock::time_point returned);
+}
+
+#endif // CHATAPP_CLOCK_HPP
@@ -0,0 +1,164 @@
+/**
+ * @file Duplicates.cpp
+ * @brief Implements the Chat::DuplicateFilter class
+ * @author Noak Palander
+ * @version 1.0
+ * @see Duplicates.hpp
+ */
+
+#include "Duplicates.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace Chat {
+    namespace {
+        /**
+         * @brief The number of fingerprints relocated before giving up on an insertion
+         */
+        constexpr int MaxKicks = 256;
+
+        /**
+         * @brief Scrambles the identity, identities are already hashes but std::hash of an integer is the identity function
+         */
+        constexpr std::uint64_t Mix(std::uint64_t value) noexcept {
+            value ^= value >> 33;
+            value *= 0xff51afd7ed558ccdULL;
+            value ^= value >> 33;
+            value *= 0xc4ceb9fe1a85ec53ULL;
+            value ^= value >> 33;
+            return value;
+        }
+    }
+
+    DuplicateFilter::DuplicateFilter(std::size_t window)
+        :   ring_(window)
+    {
+        if (window == 0)
+            return;
+
+        // Twice as many slots as identities keeps the filter at most half full
+        std::size_t const buckets = std::bit_ceil(std::max<std::size_t>(window * 2 / Slots, 1));
+        table_.assign(buckets * Slots, Entry{ .fingerprint = 0, .index = 0 });
+        mask_ = buckets - 1;
+    }
+
+    DuplicateFilter::Location DuplicateFilter::Locate(std::uint64_t id) const noexcept {
+        std::uint64_t const mixed = Mix(id);
+
+        // 0 marks an empty slot
+        auto fingerprint = static_cast<std::uint32_t>(mixed >> 32);
+        if (fingerprint == 0)
+            fingerprint = 1;
+
+        std::size_t const first = static_cast<std::size_t>(mixed) & mask_;
+        return Location{ .fingerprint = fingerprint, .first = first, .second = Alternate(first, fingerprint) };
+    }
+
+    std::size_t DuplicateFilter::Alternate(std::size_t bucket, std::uint32_t fingerprint) const noexcept {
+        return (bucket ^ static_cast<std::size_t>(Mix(fingerprint))) & mask_;
+    }
+
+    bool DuplicateFilter::Contains(std::uint64_t id) const noexcept {
+        return !table_.empty() && Find(Locate(id), id);
+    }
+
+    bool DuplicateFilter::Find(Location const& location, std::uint64_t id) const noexcept {
+        auto const* a = table_.data() + location.first * Slots;
+        auto const* b = table_.data() + location.second * Slots;
+
+        // The fingerprints are compared without branching, a match is rare and only a candidate, the identity it points at
+        // in the ring decides
+        unsigned matches = 0;
+        for (std::size_t slot = 0; slot < Slots; ++slot) {
+            matches |= static_cast<unsigned>(a[slot].fingerprint == location.fingerprint) << slot;
+            matches |= static_cast<unsigned>(b[slot].fingerprint == location.fingerprint) << (slot + Slots);
+        }
+
+        for (; matches != 0; matches &= matches - 1) {
+            auto const slot = static_cast<std::size_t>(std::countr_zero(matches));
+            if (ring_[(slot < Slots ? a : b)[slot % Slots].index] == id)
+                return true;
+        }
+
+        return false;
+    }
+
+    bool DuplicateFilter::Place(std::size_t bucket, Entry entry) noexcept {
+        auto* slots = table_.data() + bucket * Slots;
+
+        // Which slot is free is unpredictable, so they're all compared instead of branching on each one
+        unsigned free = 0;
+        for (std::size_t slot = 0; slot < Slots; ++slot)
+            free |= static_cast<unsigned>(slots[slot].fingerprint == 0) << slot;
+
+        if (free == 0)
+            return false;
+
+        slots[std::countr_zero(free)] = entry;
+        return true;
+    }
+
+    bool DuplicateFilter::Insert(std::uint64_t id) {
+        if (table_.empty())
+            return true;
+
+        auto location = Locate(id);
+        if (Find(location, id))
+            return false;
+
+        // Slides the window, the oldest identity is forgotten
+        std::size_t index = size_;
+        if (size_ == ring_.size()) {
+            index = head_;
+            Remove(head_);
+            if (++head_ == ring_.size())
+                head_ = 0;
+        }
+        else
+            ++size_;
+
+        ring_[index] = id;
+
+        Entry entry{ .fingerprint = location.fingerprint, .index = static_cast<std::uint32_t>(index) };
+        if (Place(location.first, entry) || Place(location.second, entry))
+            return true;
+
+        // Both buckets are full, relocates random fingerprints to their alternate bucket until one fits
+        std::size_t bucket = location.second;
+        for (int kick = 0; kick < MaxKicks; ++kick) {
+            random_ ^= random_ << 13;
+            random_ ^= random_ >> 17;
+            random_ ^= random_ << 5;
+
+            std::swap(entry, table_[bucket * Slots + random_ % Slots]);
+            bucket = Alternate(bucket, entry.fingerprint);
+
+            if (Place(bucket, entry))
+                return true;
+        }
+
+        // Practically unreachable at half load, the displaced identity is forgotten early
+        return true;
+    }
+
+    void DuplicateFilter::Remove(std::size_t index) noexcept {
+        auto const [fingerprint, first, second] = Locate(ring_[index]);
+        auto* a = table_.data() + first * Slots;
+        auto* b = table_.data() + second * Slots;
+
+        // The position tells the entry apart from another identity in the window with the same fingerprint
+        unsigned matches = 0;
+        for (std::size_t slot = 0; slot < Slots; ++slot) {
+            matches |= static_cast<unsigned>(a[slot].fingerprint == fingerprint && a[slot].index == index) << slot;
+            matches |= static_cast<unsigned>(b[slot].fingerprint == fingerprint && b[slot].index == index) << (slot + Slots);
+        }
+
+        // It may have been displaced by a failed insertion
+        if (matches == 0)
+            return;
+
+        auto const slot = static_cast<std::size_t>(std::countr_zero(matches));
+        (slot < Slots ? a : b)[slot % Slots].fingerprint = 0;
+    }
+}
@@ -0,0 +1,105 @@
+/**
+ * @file Duplicates.hpp
+ * @brief Contains the declaration of the Chat::DuplicateFilter class, a fixed-memory window of recently seen message identities
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_DUPLICATES_HPP
+#define CHATAPP_DUPLICATES_HPP
+
+#include <cstdint>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @class Chat::DuplicateFilter
+     * @brief Remembers the identities of the most recent messages, so a retransmitted message can be recognized in O(1)
+     * @author Noak Palander
+     *
+     * The identities are kept in a cuckoo filter of 32-bit fingerprints, each identity can be in one of two buckets of four.
+     * A ring of the identities in insertion order makes it a sliding window, once it's full the oldest identity is removed
+     * from the filter before the next one is inserted, so the memory never grows. The filter is sized to stay at most half
+     * full, where inserting practically never fails.
+     *
+     * Every slot also keeps the position of its identity in the ring, so a matching fingerprint is confirmed against the
+     * exact identity. A new message is never mistaken for a duplicate, a dropped message would be acknowledged and lost.
+     */
+    class DuplicateFilter {
+    public:
+        /**
+         * @param window the number of identities remembered, 0 disables the filter
+         */
+        explicit DuplicateFilter(std::size_t window);
+
+        /**
+         * @brief Remembers an identity
+         * @param id the identity of the message
+         * @return true if it wasn't seen within the window, false if it's a duplicate
+         */
+        bool Insert(std::uint64_t id);
+
+        /**
+         * @param id the identity of the message
+         * @return true if it was seen within the window
+         */
+        [[nodiscard]] bool Contains(std::uint64_t id) const noexcept;
+
+        /**
+         * @return the number of identities currently remembered
+         */
+        [[nodiscard]] std::size_t Size() const noexcept { return size_; }
+
+    private:
+        static constexpr std::size_t Slots = 4;
+
+        /**
+         * @brief A slot of the filter, the fingerprint 0 marks an empty slot
+         */
+        struct Entry {
+            std::uint32_t fingerprint;
+            std::uint32_t index;            /**< Where the identity is in the ring */
+        };
+
+        struct Location {
+            std::uint32_t fingerprint;
+            std::size_t first;
+            std::size_t second;
+        };
+
+        /**
+         * @brief Internal, where an identity's fingerprint can be stored
+         */
+        [[nodiscard]] Location Locate(std::uint64_t id) const noexcept;
+
+        /**
+         * @brief Internal, whether an identity is stored in either of its buckets
+         */
+        [[nodiscard]] bool Find(Location const& location, std::uint64_t id) const noexcept;
+
+        /**
+         * @brief Internal, the alternate bucket of a fingerprint, applying it twice gives the original bucket
+         */
+        [[nodiscard]] std::size_t Alternate(std::size_t bucket, std::uint32_t fingerprint) const noexcept;
+
+        /**
+         * @brief Internal, stores an entry in a free slot of a bucket
+         * @return false if the bucket is full
+         */
+        bool Place(std::size_t bucket, Entry entry) noexcept;
+
+        /**
+         * @brief Internal, removes the identity at a position in the ring, used to slide the window
+         */
+        void Remove(std::size_t index) noexcept;
+
+        std::vector<Entry> table_;          /**< Slots times the number of buckets */
+        std::size_t mask_ = 0;              /**< The number of buckets minus one, it's a power of two */
+        std::vector<std::uint64_t> ring_;   /**< The remembered identities, oldest first from head_ */
+        std::size_t head_ = 0;
+        std::size_t size_ = 0;
+        std::uint32_t random_ = 0x9e3779b9; /**< Picks which fingerprint to relocate when both buckets are full */
+    };
+}
+
+#endif // CHATAPP_DUPLICATES_HPP
@@ -0,0 +1,47 @@
+/**
+ * @file Limits.cpp
+ * @brief Implements the Chat::TokenBucket class
+ * @author Noak Palander
+ * @version 1.0
+ * @see Limits.hpp
+ */
+
+#include "Limits.hpp"
+
+#include <algorithm>
+
+namespace Chat {
+    TokenBucket::TokenBucket(double rate, double burst)
+        :   rate_{rate},
+            burst_{std::max(burst, 1.0)},
+            tokens_{burst_}
+    {}
+
+    bool TokenBucket::Ready(Clock::time_point now) noexcept {
+        Refill(now);
+        return Unlimited() || tokens_ >= 0.0;
+    }
+
+    void TokenBucket::Charge(double cost, Clock::time_point now) noexcept {
+        Refill(now);
+        if (!Unlimited())
+            tokens_ -= cost;
+    }
+
+    void TokenBucket::Refill(Clock::time_point now) noexcept {
+        std::chrono::duration<double> const elapsed = now - refilled_;
+        if (Unlimited() || elapsed.count() <= 0.0)
+            return;
+
+        tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+        refilled_ = now;
+    }
+
+    std::chrono::nanoseconds TokenBucket::Debt() const noexcept {
+        if (Unlimited() || tokens_ >= 0.0)
+            return std::chrono::nanoseconds(0);
+
+        // Rounded up, so the bucket is never still overdrawn when the wait is over
+        return std::chrono::nanoseconds(static_cast<std::int64_t>(-tokens_ / rate_ * 1e9) + 1);
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file Limits.hpp
+ * @brief Contains the rate limits of sessions and of the acceptor, and the Chat::TokenBucket class that enforces them
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_LIMITS_HPP
+#define CHATAPP_LIMITS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Chat {
+    /**
+     * @enum Chat::Throttle
+     * @brief What a session does with a peer that sends faster than its rate limits
+     * @author Noak Palander
+     */
+    enum class Throttle {
+        Delay = 0,      /**< Reading pauses until the peer is back within its limits, TCP then slows the peer down */
+        Drop = 1,       /**< Frames above the limits are discarded unread by the handlers */
+        Disconnect = 2  /**< The peer is disconnected at its first frame above the limits */
+    };
+
+    /**
+     * @struct Chat::RateLimits
+     * @brief The inbound rate limits of every client session, links between servers are exempt
+     * @author Noak Palander
+     *
+     * Acknowledgements, clock replies and echoed heartbeats answer what was sent to the client, so they aren't counted as
+     * messages, only a frame of exactly such an answer's size is. Their bytes are charged like every other frame's.
+     */
+    struct RateLimits {
+        double messagesPerSecond = 0.0;         /**< Frames per second, 0 is unlimited */
+        double bytesPerSecond = 0.0;            /**< Bytes per second including the framing, 0 is unlimited */
+        std::chrono::milliseconds burst{1000};  /**< How long an idle peer saves up its unused rate for */
+        Throttle action = Throttle::Delay;      /**< What happens once a peer is above either limit */
+    };
+
+    /**
+     * @struct Chat::Admission
+     * @brief Limits the connections a server accepts
+     * @author Noak Palander
+     */
+    struct Admission {
+        double acceptsPerSecond = 0.0;          /**< New connections per second, accepting pauses above it, 0 is unlimited */
+        std::size_t acceptBurst = 32;           /**< How many connections can be accepted at once after a quiet period */
+        std::size_t maxConnections = 0;         /**< Clients connected at once, links don't count, further ones are closed right away, 0 is unlimited */
+    };
+
+    /**
+     * @struct Chat::ThrottleStats
+     * @brief How often the limits were enforced
+     * @author Noak Palander
+     */
+    struct ThrottleStats {
+        std::uint64_t delayed = 0;          /**< Reads paused under Throttle::Delay */
+        std::uint64_t dropped = 0;          /**< Frames discarded under Throttle::Drop */
+        std::uint64_t disconnected = 0;     /**< Sessions closed under Throttle::Disconnect */
+        std::uint64_t rejected = 0;         /**< Connections closed above Admission::maxConnections */
+        std::uint64_t acceptsDelayed = 0;   /**< Times accepting paused above Admission::acceptsPerSecond */
+    };
+
+    /**
+     * @class Chat::TokenBucket
+     * @brief Refills at a fixed rate up to a burst, and may be overdrawn by a single cost
+     * @author Noak Palander
+     *
+     * Letting the last cost overdraw the bucket means a frame larger than the burst still passes eventually, the debt is then
+     * paid back before the next one is admitted. A default constructed bucket is unlimited.
+     */
+    class TokenBucket {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        TokenBucket() = default;
+
+        /**
+         * @param rate tokens per second, 0 or less is unlimited
+         * @param burst the most tokens saved up, the bucket starts out full
+         */
+        TokenBucket(double rate, double burst);
+
+        /**
+         * @brief Refills the bucket up to now
+         * @return true if it isn't overdrawn, a cost can then be charged
+         */
+        bool Ready(Clock::time_point now) noexcept;
+
+        /**
+         * @brief Refills the bucket up to now, and takes tokens out of it, it may go into debt
+         */
+        void Charge(double cost, Clock::time_point now) noexcept;
+
+        /**
+         * @return how long until the debt is paid back, as of the last refill, 0 if there's none
+         */
+        [[nodiscard]] std::chrono::nanoseconds Debt() const noexcept;
+
+        [[nodiscard]] bool Unlimited() const noexcept { return rate_ <= 0.0; }
+
+    private:
+        /**
+         * @brief Internal, adds the tokens accumulated since the last refill
+         */
+        void Refill(Clock::time_point now) noexcept;
+
+        double rate_ = 0.0;
+        double burst_ = 0.0;
+        double tokens_ = 0.0;
+        Clock::time_point refilled_ = Clock::now();
+    };
+}
+
+#endif // CHATAPP_LIMITS_HPP
@@ -7,16 +7,64 @@
  */
 
 #include "Message.hpp"
+#include "Utf8.hpp"
+#include "Wire.hpp"
+#include <atomic>
+#include <limits>
+#include <string_view>
 
 
 namespace Chat {
-    Message::Message(MessageType type, std::chrono::system_clock::time_point timestamp, std::string data)
-        :   type_{type}, timestamp_{timestamp}, data_{std::move(data)} {
+    namespace {
+        /**
+         * @brief The sequence number of the next message constructed by this process
+         */
+        std::uint64_t NextSequence() noexcept {
+            static std::atomic<std::uint64_t> sequence{0};
+            return sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+
+        /**
+         * @brief Derives the ID of a message, 64-bit FNV-1a over the contents followed by the timestamp
+         *
+         * The ID travels in the header, peers only compare it, but it's specified so that every build derives the same one,
+         * unlike std::hash, which differs between standard libraries.
+         */
+        Message::HashType Fnv1a(std::string_view data, std::int64_t nanoseconds) noexcept {
+            constexpr std::uint64_t Prime = 0x100000001b3;
+            std::uint64_t hash = 0xcbf29ce484222325;
+
+            for (char const c : data)
+                hash = (hash ^ static_cast<unsigned char>(c)) * Prime;
+
+            // The timestamp is hashed as its little-endian wire bytes
+            for (int shift = 0; shift < 64; shift += 8)
+                hash = (hash ^ ((static_cast<std::uint64_t>(nanoseconds) >> shift) & 0xff)) * Prime;
+
+            return hash;
+        }
+    }
+
+    Message::Message(MessageType type, std::chrono::system_clock::time_point timestamp, std::string data, std::string room)
+        :   type_{type}, timestamp_{timestamp}, data_{std::move(data)}, room_{std::move(room)} {
+
+        // Text from a peer may be malformed, it's repaired before anything displays it
+        auto const roomText = Utf8::Sanitize(room_);
+        auto const dataText = Utf8::Sanitize(data_);
+        text_ = roomText == TextKind::Ascii && dataText == TextKind::Ascii ? TextKind::Ascii : TextKind::Unicode;
+
+        // The room name is prefixed by a single length byte, it's cut between characters
+        if (room_.size() > std::numeric_limits<unsigned char>::max()) {
+            std::size_t length = std::numeric_limits<unsigned char>::max();
+            while (length > 0 && (static_cast<unsigned char>(room_[length]) & 0xc0) == 0x80)
+                --length;
+            room_.resize(length);
+        }
 
         if (!data_.ends_with('\n'))
             data_ += '\n';
 
-        hash_ = std::hash<std::string>()(data_ + std::to_string(timestamp_.time_since_epoch().count()));
+        hash_ = Fnv1a(data_, std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp_.time_since_epoch()).count());
     }
 
     Message::Message(MessageType type, std::chrono::system_clock::time_point timestamp, HashType hash)
@@ -28,37 +76,49 @@ namespace Chat {
      * @return the new message
      */
     [[nodiscard]] Message Message::Acknowledge() const {
-        // Returns a new acknowledge-message, provides a new timestamp but keeps the hash for validation
-        return Message(MessageType::Acknowledge, std::chrono::system_clock::now(), hash_);
+        // Returns a new acknowledge-message, provides a new timestamp but keeps the hash and sequence for validation
+        Message acknowledgement(MessageType::Acknowledge, std::chrono::system_clock::now(), hash_);
+        acknowledgement.sequence_ = sequence_;
+        return acknowledgement;
     }
 
     /**
      * @brief Serializes the message into a packet
      * @return the packet corresponding to the current message
      *
-     * The packet structure is:
-     * 1B = type byte (New/Acknowledge),
-     * 8B = hash (consisting of the timestamp and message contents),
-     * 8B = timestamp,
+     * The packet starts with the 32 byte Wire::Header, every integer is little-endian:
+     * 4B = length of the remainder of the packet,
+     * 1B = type byte (New/Acknowledge/Join/Leave),
+     * 1B = version of the header,
+     * 1B = flags,
+     * 1B = length of the room name,
+     * 8B = sequence number of the message at the sender,
+     * 8B = timestamp, nanoseconds since the epoch,
+     * 8B = ID, the FNV-1a hash of the contents and timestamp at the sender, kept as is by the receiver,
+     * xB = room name, this is empty for acknowledgements,
      * Remainder = contents, char[] delimited by a newline, this can be empty
      */
     [[nodiscard]]
     std::vector<std::byte> Message::Serialize() const {
-        std::vector<std::byte> packet(1 + sizeof(HashType) + sizeof(std::uint64_t) + data_.size());
+        std::vector<std::byte> packet(sizeof(Wire::Header) + room_.size() + data_.size());
         std::byte* ptr = packet.data();
 
-        // Type byte
-        packet[0] = static_cast<std::byte>(type_);
-        ++ptr;
-
-        // Hash
-        std::memcpy(ptr, &hash_, sizeof(HashType));
-        ptr += sizeof(HashType);
-
-        // Timestamp
-        std::uint64_t time = timestamp_.time_since_epoch().count();
-        std::memcpy(ptr, &time, sizeof(std::uint64_t));
-        ptr += sizeof(std::uint64_t);
+        // The whole header is stored at once
+        Wire::StoreHeader(ptr, Wire::Header{
+            .length = static_cast<std::uint32_t>(packet.size() - sizeof(std::uint32_t)),
+            .type = type_,
+            .version = Wire::Version,
+            .flags = 0,
+            .room = static_cast<std::uint8_t>(room_.size()),
+            .sequence = sequence_,
+            .timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp_.time_since_epoch()).count(),
+            .id = hash_
+        });
+        ptr += sizeof(Wire::Header);
+
+        // Room
+        std::memcpy(ptr, room_.data(), room_.size());
+        ptr += room_.size();
 
         // Content
         std::memcpy(ptr, data_.data(), data_.size());
@@ -66,55 +126,93 @@ namespace Chat {
     }
 
     /**
-     * @brief Deserializes a packet assumed to be structured like the serialization specifies.
+     * @brief Deserializes a packet structured like the serialization specifies
      * @param packet deserialized into a message
-     * @return the message corresponding to the packet
+     * @return the message corresponding to the packet, or nothing if it's malformed, of another version, or not a message
      */
     [[nodiscard]]
-    Message Message::Deserialize(std::vector<std::byte> const& packet) {
-        // The beginning of the packet
-        std::byte const* data = packet.data();
-
-        // Deserializes the type
-        auto const type = static_cast<MessageType>(packet[0]);
-        ++data;
-
-        // Deserializes the hash
-        HashType hash;
-        std::memcpy(&hash, data, sizeof(HashType));
-        data += sizeof(HashType);
-
-        // Deserializes the timestamp
-        std::uint64_t time{};
-        std::memcpy(&time, data, sizeof(std::uint64_t));
-        data += sizeof(std::uint64_t);
-        using std::chrono::system_clock;
-        system_clock::time_point timestamp(duration_cast<system_clock::time_point::duration>(std::chrono::nanoseconds(time)));
+    std::optional<Message> Message::Deserialize(std::span<std::byte const> packet) {
+        if (packet.size() < sizeof(Wire::Header))
+            return std::nullopt;
 
-        // If the message type is a new message
-        if (type == MessageType::New) {
-            // Deserializes the message content
-            char const *begin = reinterpret_cast<char const *>(data);
-            char const *end = reinterpret_cast<char const *>(std::to_address(packet.end()));
-            std::string contents(begin, end);
+        auto const header = Wire::LoadHeader(packet.data());
+        if (header.version != Wire::Version || header.length != packet.size() - sizeof(std::uint32_t) ||
+            header.room > packet.size() - sizeof(Wire::Header))
+            return std::nullopt;
+
+        using std::chrono::system_clock;
+        system_clock::time_point const timestamp(
+            std::chrono::duration_cast<system_clock::duration>(std::chrono::nanoseconds(header.timestamp)));
+
+        // The room and the contents follow the header
+        auto const* data = reinterpret_cast<char const*>(packet.data() + sizeof(Wire::Header));
+        auto const* end = reinterpret_cast<char const*>(std::to_address(packet.end()));
+        std::string room(data, header.room);
+
+        std::optional<Message> message;
+        switch (header.type) {
+            // A new message carries its contents
+            case MessageType::New:
+                message.emplace(header.type, timestamp, std::string(data + header.room, end), std::move(room));
+                break;
+
+            // Room subscriptions only carry the room
+            case MessageType::Join:
+            case MessageType::Leave:
+                message.emplace(header.type, timestamp, "\n", std::move(room));
+                break;
 
-            return Message(type, timestamp, contents);
-        }
-        // If the message is an acknowledgement
-        else {
             // Brings no new content, provide the timestamp and the hash for the acknowledged message
-            return Message(type, timestamp, hash);
+            case MessageType::Acknowledge:
+                message.emplace(header.type, timestamp, header.id);
+                break;
+
+            // Every other type has its own layout
+            default:
+                return std::nullopt;
         }
+
+        // The ID is the sender's, repairing the text above mustn't change it, acknowledgements and duplicates are matched by it
+        message->hash_ = header.id;
+        message->sequence_ = header.sequence;
+        return message;
     }
 
     /**
      * @brief Constructs a new message (MessageType = New), based on the current time, and contents
      * @param str the message contents
+     * @param room the room the message is published to
      * @return a new message
      */
     [[nodiscard]]
-    Message Message::From(std::string const& str) {
+    Message Message::From(std::string const& str, std::string room) {
         // Constructs a new message given the current time, and the provided message content
-        return Message(MessageType::New, std::chrono::system_clock::now(), str);
+        Message message(MessageType::New, std::chrono::system_clock::now(), str, std::move(room));
+        message.sequence_ = NextSequence();
+        return message;
+    }
+
+    /**
+     * @brief Constructs a control message which subscribes the sender to a room
+     * @param room the name of the room, at most 255 bytes
+     * @return a new message
+     */
+    [[nodiscard]]
+    Message Message::Join(std::string room) {
+        Message message(MessageType::Join, std::chrono::system_clock::now(), "\n", std::move(room));
+        message.sequence_ = NextSequence();
+        return message;
+    }
+
+    /**
+     * @brief Constructs a control message which unsubscribes the sender from a room
+     * @param room the name of the room, at most 255 bytes
+     * @return a new message
+     */
+    [[nodiscard]]
+    Message Message::Leave(std::string room) {
+        Message message(MessageType::Leave, std::chrono::system_clock::now(), "\n", std::move(room));
+        message.sequence_ = NextSequence();
+        return message;
     }
 }
\ No newline at end of file
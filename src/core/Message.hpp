@@ -8,12 +8,16 @@
 #ifndef CHATAPP_MESSAGE_HPP
 #define CHATAPP_MESSAGE_HPP
 
+#include "Utf8.hpp"
 #include <cstdint>
 #include <string_view>
 #include <string>
 #include <vector>
 #include <cstring>
 #include <chrono>
+#include <memory>
+#include <optional>
+#include <span>
 
 namespace Chat {
     /**
@@ -23,9 +27,35 @@ namespace Chat {
      */
     enum class MessageType : unsigned char {
         New = 0,            /**< Indicates that the message is a completely new message */
-        Acknowledge = 1     /**< Indiciates that the message is an acknowledgement to a previous one */
+        Acknowledge = 1,    /**< Indiciates that the message is an acknowledgement to a previous one */
+        Join = 2,           /**< A control message, subscribes the sender to the message's room, the server sends it back once it's a member */
+        Leave = 3,          /**< A control message, unsubscribes the sender from the message's room, the server sends one to a client that
+                                 isn't a member, when its join was refused or it published to the room anyway */
+        Offer = 4,          /**< Announces a chunked transfer, see Transfer.hpp, not a Chat::Message */
+        Chunk = 5,          /**< A part of a chunked transfer, see Transfer.hpp, not a Chat::Message */
+        ClockProbe = 6,     /**< Asks the peer for its clock, see Clock.hpp, not a Chat::Message */
+        ClockReply = 7,     /**< Answers a clock probe, see Clock.hpp, not a Chat::Message */
+        Link = 8,           /**< Establishes a link between federated servers, see Relay.hpp, not a Chat::Message */
+        Relay = 9,          /**< A batch of messages relayed between federated servers, see Relay.hpp, not a Chat::Message */
+        Heartbeat = 10,     /**< Keeps an idle connection probed, and samples its round trip, see Session.hpp, not a Chat::Message */
+        Count               /**< The number of message types, not a type */
     };
 
+    /**
+     * @brief The number of message types, every type byte at or above it is rejected
+     */
+    inline constexpr std::size_t MessageTypeCount = static_cast<std::size_t>(MessageType::Count);
+
+    /**
+     * @brief The room every connection is subscribed to when it connects
+     */
+    inline constexpr std::string_view DefaultRoom = "lobby";
+
+    /**
+     * @brief A serialized packet, shared so that the same bytes can be queued on several sessions without copying
+     */
+    using Packet = std::shared_ptr<std::vector<std::byte> const>;
+
     /**
      * @class Chat::Message
      * @brief The class that's used for transmitting messages between the client and server
@@ -33,9 +63,9 @@ namespace Chat {
      */
     class Message {
     public:
-        using HashType = std::size_t;
+        using HashType = std::uint64_t;
 
-        Message(MessageType type, std::chrono::system_clock::time_point timestamp, std::string data);
+        Message(MessageType type, std::chrono::system_clock::time_point timestamp, std::string data, std::string room = std::string(DefaultRoom));
         Message(MessageType type, std::chrono::system_clock::time_point timestamp, HashType hash);
 
         ~Message() = default;
@@ -57,39 +87,70 @@ namespace Chat {
          * @brief Serializes the message into a packet
          * @return the packet corresponding to the current message
          *
-         * The packet structure is:
-         * 1B = type byte (New/Acknowledge),
-         * 8B = hash (consisting of the timestamp and message contents),
-         * 8B = timestamp,
+         * The packet starts with the 32 byte Wire::Header, every integer is little-endian:
+         * 4B = length of the remainder of the packet,
+         * 1B = type byte (New/Acknowledge/Join/Leave),
+         * 1B = version of the header,
+         * 1B = flags,
+         * 1B = length of the room name,
+         * 8B = sequence number of the message at the sender,
+         * 8B = timestamp, nanoseconds since the epoch,
+         * 8B = ID, the FNV-1a hash of the contents and timestamp at the sender, kept as is by the receiver,
+         * xB = room name, this is empty for acknowledgements,
          * Remainder = contents, char[] delimited by a newline, this can be empty
          */
         [[nodiscard]] std::vector<std::byte> Serialize() const;
 
         /**
-         * @brief Deserializes a packet assumed to be structured like the serialization specifies.
+         * @brief Deserializes a packet structured like the serialization specifies
          * @param packet deserialized into a message
-         * @return the message corresponding to the packet
+         * @return the message corresponding to the packet, or nothing if it's malformed, of another version, or not a message
          */
-        [[nodiscard]] static Message Deserialize(std::vector<std::byte> const& packet);
+        [[nodiscard]] static std::optional<Message> Deserialize(std::span<std::byte const> packet);
 
         /**
          * @brief Constructs a new message (MessageType = New), based on the current time, and contents
          * @param str the message contents
+         * @param room the room the message is published to
+         * @return a new message
+         */
+        [[nodiscard]] static Message From(std::string const& str, std::string room = std::string(DefaultRoom));
+
+        /**
+         * @brief Constructs a control message which subscribes the sender to a room
+         * @param room the name of the room, at most 255 bytes
+         * @return a new message
+         */
+        [[nodiscard]] static Message Join(std::string room);
+
+        /**
+         * @brief Constructs a control message which unsubscribes the sender from a room
+         * @param room the name of the room, at most 255 bytes
          * @return a new message
          */
-        [[nodiscard]] static Message From(std::string const& str);
+        [[nodiscard]] static Message Leave(std::string room);
 
         [[nodiscard]] MessageType Type() const noexcept { return type_; }
         [[nodiscard]] std::chrono::system_clock::time_point Timestamp() const noexcept { return timestamp_; }
         [[nodiscard]] std::string Contents() const noexcept { return data_; }
         [[nodiscard]] HashType Identifier() const noexcept { return hash_; }
+        [[nodiscard]] std::uint64_t Sequence() const noexcept { return sequence_; }
+        [[nodiscard]] std::string const& Room() const noexcept { return room_; }
+
+        /**
+         * @return whether the room and contents are plain ASCII, they are always valid UTF-8 without control characters
+         */
+        [[nodiscard]] TextKind Text() const noexcept { return text_; }
 
 
     private:
         MessageType type_;
         std::chrono::system_clock::time_point timestamp_;
         std::string data_;
+        std::string room_;
         HashType hash_;
+        std::uint64_t sequence_ = 0;    /**< Set by the factories, and kept by acknowledgements */
+        TextKind text_ = TextKind::Ascii;
     };
 }
 
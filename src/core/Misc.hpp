@@ -1,6 +1,6 @@
 /**
  * @file Misc.hpp
- * @brief Contains various helpers for the application
+ * @brief Contains various helpers for the application, without any dependency on Qt
  * @author Noak Palander
  * @version 1.0
  */
@@ -8,39 +8,23 @@
 #ifndef CHATAPP_MISC_HPP
 #define CHATAPP_MISC_HPP
 
-#include <QString>
+#include <string>
 #include <string_view>
-#include <algorithm>
+#include <iterator>
 #include "fmt/format.h"
-#include "fmt/color.h"
-#include <iostream>
 
 namespace Misc {
     /**
-     * @brief Provides an fmt::format version that produces a QString instead of an std::string
+     * @brief Provides an fmt::format version with a format string that's only known at runtime
      * @param format the format string, follows fmtlib formatting
      * @param args the args that should be formatted into the string
-     * @return the formatted output as a QString
+     * @return the formatted output
      */
     template<typename... Args>
-    [[nodiscard]] inline QString QFormat(std::string_view format, Args&&... args) {
+    [[nodiscard]] inline std::string Format(std::string_view format, Args&&... args) {
         std::string out;
-        fmt::vformat_to(std::back_inserter(out), format, fmt::make_format_args(std::forward<Args>(args)...));
-        return QString::fromStdString(out);
-    }
-
-    /**
-     * @brief Prints some color-coded string to stderr and flushes it, if the current build mode is Debug, otherwise it does nothing
-     * @param format the format string, follows fmtlib formatting
-     * @param args the args that should be formatted into the string
-     */
-    template<typename... Args>
-    inline constexpr void Debug(std::string_view format, Args&&... args) {
-    #ifdef DEBUG
-        // Underlined red-color
-        fmt::print(::stderr, fmt::emphasis::underline | fg(fmt::color::red), format, std::forward<Args>(args)...);
-        std::cerr.flush();
-    #endif
+        fmt::vformat_to(std::back_inserter(out), format, fmt::make_format_args(args...));
+        return out;
     }
 }
 
@@ -0,0 +1,62 @@
+/**
+ * @file Pool.cpp
+ * @brief Implements the Chat::SlabPool class
+ * @author Noak Palander
+ * @version 1.0
+ * @see Pool.hpp
+ */
+
+#include "Pool.hpp"
+
+#include <algorithm>
+
+namespace Chat {
+    SlabPool::SlabPool(std::size_t slabSize, std::size_t cached)
+        :   slabSize_{std::max(slabSize, MinSlab)},
+            limit_{cached}
+    {
+        free_.reserve(limit_);
+    }
+
+    SlabPool::Slab SlabPool::Acquire() {
+        {
+            std::lock_guard lock(mutex_);
+            peak_ = std::max(peak_, ++inUse_);
+
+            if (!free_.empty()) {
+                ++reused_;
+                Slab slab = std::move(free_.back());
+                free_.pop_back();
+                return slab;
+            }
+
+            ++allocated_;
+        }
+
+        // Allocated outside of the lock, a received frame overwrites the slab anyway so it's left uninitialized
+        return std::make_unique_for_overwrite<std::byte[]>(slabSize_);
+    }
+
+    void SlabPool::Release(Slab slab) noexcept {
+        if (!slab)
+            return;
+
+        std::lock_guard lock(mutex_);
+        --inUse_;
+
+        if (free_.size() < limit_)
+            free_.push_back(std::move(slab));
+    }
+
+    PoolStats SlabPool::Stats() const {
+        std::lock_guard lock(mutex_);
+        return PoolStats{
+            .slabSize = slabSize_,
+            .inUse = inUse_,
+            .cached = free_.size(),
+            .peak = peak_,
+            .allocated = allocated_,
+            .reused = reused_
+        };
+    }
+}
@@ -0,0 +1,86 @@
+/**
+ * @file Pool.hpp
+ * @brief Contains the declaration of the Chat::SlabPool class, fixed-size receive buffers shared by every session
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_POOL_HPP
+#define CHATAPP_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @struct Chat::PoolStats
+     * @brief A snapshot of a slab pool's occupancy
+     * @author Noak Palander
+     */
+    struct PoolStats {
+        std::size_t slabSize;
+        std::size_t inUse;          /**< Slabs currently holding a frame being received */
+        std::size_t cached;         /**< Free slabs kept for reuse */
+        std::size_t peak;           /**< The most slabs in use at once */
+        std::uint64_t allocated;    /**< Slabs allocated from the heap since the pool was constructed */
+        std::uint64_t reused;       /**< Slabs handed out from the cache */
+    };
+
+    /**
+     * @class Chat::SlabPool
+     * @brief Hands out fixed-size slabs that sessions receive frames into, and keeps a bounded number of released slabs
+     * @author Noak Palander
+     *
+     * A session only holds slabs while a frame is arriving, and returns them as soon as the frame has been dispatched, so an idle
+     * connection holds none. Frames larger than a slab are received into a chain of slabs. Every member function can be called
+     * from any thread, a slab may be released by a session that's destroyed outside of the io thread.
+     */
+    class SlabPool {
+    public:
+        using Slab = std::unique_ptr<std::byte[]>;
+
+        /**
+         * @brief The smallest slab, large enough for every fixed header
+         */
+        static constexpr std::size_t MinSlab = 256;
+
+        /**
+         * @param slabSize the size of every slab, raised to MinSlab
+         * @param cached the most free slabs kept for reuse, the rest are returned to the heap
+         */
+        SlabPool(std::size_t slabSize, std::size_t cached);
+
+        /**
+         * @return a slab of SlabSize bytes, its content is indeterminate
+         */
+        [[nodiscard]] Slab Acquire();
+
+        /**
+         * @brief Returns a slab to the pool
+         * @param slab a slab acquired from this pool, or null
+         */
+        void Release(Slab slab) noexcept;
+
+        [[nodiscard]] std::size_t SlabSize() const noexcept { return slabSize_; }
+
+        /**
+         * @return a snapshot of the occupancy
+         */
+        [[nodiscard]] PoolStats Stats() const;
+
+    private:
+        std::size_t slabSize_;
+        std::size_t limit_;                 /**< The most free slabs kept */
+        mutable std::mutex mutex_;          /**< Guards everything below, it's practically only taken by the io thread */
+        std::vector<Slab> free_;            /**< Reserved up front so releasing never allocates */
+        std::size_t inUse_ = 0;
+        std::size_t peak_ = 0;
+        std::uint64_t allocated_ = 0;
+        std::uint64_t reused_ = 0;
+    };
+}
+
+#endif // CHATAPP_POOL_HPP
@@ -8,146 +8,924 @@
 
 #include "Processor.hpp"
 
-#include "asio/read_until.hpp"
-#include "asio/write.hpp"
-#include "Misc.hpp"
+#include "asio/post.hpp"
+#include "Trace.hpp"
 #include "Message.hpp"
+#include <algorithm>
+#include <random>
 #include <utility>
 
 namespace Chat {
+    namespace {
+        /**
+         * @brief Generates a node ID, it only has to be unique among the federated servers
+         */
+        std::uint64_t RandomNode() {
+            std::random_device device;
+            return (static_cast<std::uint64_t>(device()) << 32) | device();
+        }
+    }
+
     /**
      * @brief Constructs a server
      * @param port the port to be used
      * @param onReceive a callback that is invoked when a message is received
      * @param onConnected a callback that is invoked when a client connects
      * @param onConnectionLost a callback that is invoked when a client disonnects
+     * @param options optional configuration
      */
     Processor::Processor(int port,
                          std::function<void(Chat::Message const&)> onReceive,
                          std::function<void()> onConnect,
-                         std::function<void()> onDisconnect)
+                         std::function<void()> onDisconnect,
+                         Options options)
         :   mode_{Mode::Server},
-            socket_{std::make_unique<asio::ip::tcp::socket>(service_)},
+            options_{std::move(options)},
             acceptor_{std::make_unique<asio::ip::tcp::acceptor>(service_, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))},
+            incoming_{options_.downloads, options_.maxTransfers, options_.downloadQuota},
+            capture_{options_.capture.empty() ? nullptr : std::make_unique<Capture>(options_.capture)},
+            seen_{options_.dedupWindow},
+            slabs_{std::make_shared<SlabPool>(options_.receiveSlab, options_.receiveSlabsCached)},
+            accepts_{options_.admission.acceptsPerSecond, static_cast<double>(options_.admission.acceptBurst)},
+            node_{RandomNode()},
             onReceive_{std::move(onReceive)},
             onConnect_{std::move(onConnect)},
             onDisconnect_{std::move(onDisconnect)}
     {
-        Misc::Debug("Constructed a server!\n");
+        Trace::Emit(Trace::Event::ServerStarted, port);
         acceptor_->set_option(asio::ip::tcp::acceptor::reuse_address(true));
 
-        // Starts accepting clients
+        // Starts accepting clients, every client receives its own session
         Accept();
 
-        // Start listening for messages
-        Receive();
-        runner_ = std::jthread([this](std::stop_token token){
-            while(!token.stop_requested()) {
-                service_.run();
-                std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                service_.restart();
-            }
-        });
+        // Links to the other federated servers, they connect to us the same way clients do
+        linkTimers_.reserve(options_.peers.size());
+        for (std::size_t peer = 0; peer < options_.peers.size(); ++peer) {
+            linkTimers_.emplace_back(service_);
+            Connect(peer);
+        }
+
+        Sample();
+        Probe();
+        Run();
     }
 
     Processor::Processor(int port, std::string const& address,
                          std::function<void(Chat::Message const&)> onReceive,
                          std::function<void()> onConnect,
-                         std::function<void()> onDisconnect)
+                         std::function<void()> onDisconnect,
+                         Options options)
         :   mode_{Mode::Client},
-            socket_{std::make_unique<asio::ip::tcp::socket>(service_)},
+            options_{std::move(options)},
+            incoming_{options_.downloads.empty() ? DefaultDownloads() : options_.downloads, options_.maxTransfers, options_.downloadQuota},
+            capture_{options_.capture.empty() ? nullptr : std::make_unique<Capture>(options_.capture)},
+            seen_{options_.dedupWindow},
+            slabs_{std::make_shared<SlabPool>(options_.receiveSlab, options_.receiveSlabsCached)},
+            node_{RandomNode()},
             onReceive_{std::move(onReceive)},
             onConnect_{std::move(onConnect)},
             onDisconnect_{std::move(onDisconnect)}
     {
-        Misc::Debug("Starting client!\n");
+        Trace::Emit(Trace::Event::ClientStarted, port);
+
+        // Attempt to connect to the server, the socket is moved into a session once connected
+        auto socket = std::make_unique<asio::ip::tcp::socket>(service_);
+        auto& connecting = *socket;
 
-        // Attempt to connect to the server
-        socket_->async_connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(address), port), [this](asio::error_code code) {
+        connecting.async_connect(asio::ip::tcp::endpoint(asio::ip::address::from_string(address), port),
+                                 [this, socket = std::move(socket)](asio::error_code code) mutable {
             // When connection was successful
-            if (code.value() == 0)
+            if (code.value() == 0) {
+                Trace::Emit(Trace::Event::Connected);
+                Open(std::move(*socket));
                 onConnect_();
-        });
-
-        // Start listening for messages
-        Receive();
-        runner_ = std::jthread([this](std::stop_token token){
-            while(!token.stop_requested()) {
-                service_.run();
-                std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                service_.restart();
+            }
+            else {
+                onDisconnect_();
             }
         });
+
+        Probe();
+        Run();
     }
 
+    Processor::Processor(Mode mode, std::function<void(Chat::Message const&)> onReceive, Options options)
+        :   mode_{mode},
+            options_{std::move(options)},
+            incoming_{options_.downloads.empty() && mode == Mode::Client ? DefaultDownloads() : options_.downloads,
+                      options_.maxTransfers, options_.downloadQuota},
+            capture_{options_.capture.empty() ? nullptr : std::make_unique<Capture>(options_.capture)},
+            seen_{options_.dedupWindow},
+            slabs_{std::make_shared<SlabPool>(options_.receiveSlab, options_.receiveSlabsCached)},
+            node_{RandomNode()},
+            onReceive_{std::move(onReceive)},
+            onConnect_{[]{}},
+            onDisconnect_{[]{}}
+    {}
+
     Processor::~Processor() {
+        // Releases producers blocked on a congested connection
+        {
+            std::lock_guard lock(flowMutex_);
+            stopping_ = true;
+        }
+        flowCv_.notify_all();
+
         runner_.request_stop();
         asio::post(service_, [this]{
             service_.stop();
         });
 
-        runner_.join();
+        // Offline processors never started the io thread
+        if (runner_.joinable())
+            runner_.join();
 
-        if (socket_->is_open()) {
-            asio::error_code ec;
-            socket_->shutdown(asio::ip::tcp::socket::shutdown_both, ec);
-            socket_->close();
+        // The io thread is gone, the sessions can be closed from here
+        std::unordered_map<Session::Id, std::shared_ptr<Session>> sessions;
+        {
+            std::lock_guard lock(sessionsMutex_);
+            sessions = sessions_;
         }
 
-        Misc::Debug("Stopping {}\n", mode_);
+        for (auto& [id, session] : sessions)
+            session->Close();
+
+        Trace::Emit(mode_ == Mode::Server ? Trace::Event::ServerStopped : Trace::Event::ClientStopped);
+    }
+
+    void Processor::Run() {
+        runner_ = std::jthread([this](std::stop_token token){
+            while(!token.stop_requested()) {
+                service_.run();
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                service_.restart();
+            }
+        });
     }
 
     void Processor::Accept() {
-        acceptor_->async_accept(*socket_, std::bind_front(&Processor::HandleAccept, this));
+        acceptor_->async_accept(std::bind_front(&Processor::HandleAccept, this));
     }
 
-    void Processor::HandleAccept(asio::error_code ec) {
+    void Processor::HandleAccept(asio::error_code ec, asio::ip::tcp::socket socket) {
+        // The acceptor was closed
+        if (ec == asio::error::operation_aborted)
+            return;
+
+        auto const now = std::chrono::steady_clock::now();
+
         // A client connected
-        if (ec.value() == 0)
-            onConnect_();
+        if (ec.value() == 0) {
+            std::size_t clients = 0;
+            {
+                std::lock_guard lock(sessionsMutex_);
+                clients = sessions_.size() - links_.size();
+            }
+
+            // Closed right away rather than left in the backlog, so the client learns that it should try again later
+            if (options_.admission.maxConnections > 0 && clients >= options_.admission.maxConnections) {
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                Trace::Emit(Trace::Event::ConnectionRejected, clients);
+
+                asio::error_code ignored;
+                socket.close(ignored);
+            }
+            else {
+                Trace::Emit(Trace::Event::Connected);
+                Open(std::move(socket));
+                onConnect_();
+            }
+
+            accepts_.Charge(1.0, now);
+        }
+
+        // Above the accept rate, new connections wait in the listen backlog until it allows them
+        if (!accepts_.Ready(now)) {
+            auto const debt = accepts_.Debt();
+            acceptsDelayed_.fetch_add(1, std::memory_order_relaxed);
+            Trace::Emit(Trace::Event::AcceptPaused, std::chrono::duration_cast<std::chrono::microseconds>(debt).count());
+
+            acceptTimer_.expires_after(debt);
+            acceptTimer_.async_wait([this](asio::error_code ec) {
+                // Drain closes the acceptor
+                if (!ec && acceptor_->is_open())
+                    Accept();
+            });
+            return;
+        }
 
         Accept();
     }
 
-    void Processor::Receive() {
-        // Reads into buffer_ when it receives some data, then invoeks the Reader callback
-        asio::async_read_until(*socket_, asio::dynamic_buffer(buffer_), '\n', std::bind_front(&Processor::Reader, this));
+    std::shared_ptr<Session> Processor::Open(asio::ip::tcp::socket socket) {
+        auto session = Register(nextSession_++, std::move(socket));
+        session->Start();
+
+        // The peer's clock is probed right away, every reply is followed by another probe until the window is full
+        session->Send(ClockProbe(), Priority::Control);
+        return session;
+    }
+
+    void Processor::Connect(std::size_t peer) {
+        // A retry that was already armed may still fire once draining, a draining server doesn't link again
+        if (!Linking())
+            return;
+
+        auto socket = std::make_unique<asio::ip::tcp::socket>(service_);
+        auto& connecting = *socket;
+        auto const& [address, port] = options_.peers[peer];
+
+        asio::error_code ec;
+        auto const ip = asio::ip::make_address(address, ec);
+        if (ec) {
+            Trace::Emit(Trace::Event::LinkFailed, peer, ec.value());
+            return;
+        }
+
+        connecting.async_connect(asio::ip::tcp::endpoint(ip, static_cast<unsigned short>(port)),
+                                 [this, peer, socket = std::move(socket)](asio::error_code code) mutable {
+            if (code) {
+                Trace::Emit(Trace::Event::LinkFailed, peer, code.value());
+                Reconnect(peer);
+                return;
+            }
+
+            // Connecting may have raced with Drain, the socket is closed as it goes out of scope
+            if (!Linking())
+                return;
+
+            auto session = Open(std::move(*socket));
+            Promote(*session, peer);
+            session->Send(LinkHello(node_), Priority::Control);
+        });
+    }
+
+    void Processor::Reconnect(std::size_t peer) {
+        if (!Linking())
+            return;
+
+        // Every peer has its own timer so that Drain can cancel the pending retries
+        auto& timer = linkTimers_[peer];
+        timer.expires_after(options_.linkRetry);
+        timer.async_wait([this, peer](asio::error_code ec) {
+            if (!ec)
+                Connect(peer);
+        });
+    }
+
+    bool Processor::Linking() {
+        std::lock_guard lock(flowMutex_);
+        return !stopping_ && !draining_;
+    }
+
+    void Processor::Promote(Session& session, std::optional<std::size_t> peer) {
+        // Links aren't members of any room, they receive relayed batches instead
+        rooms_.LeaveAll(&session);
+
+        // A link carries the traffic of every client of another server
+        session.Unlimit();
+
+        std::lock_guard lock(sessionsMutex_);
+        auto& link = links_[session.Identifier()];
+        link.stats.session = session.Identifier();
+        link.peer = peer;
+    }
+
+    bool Processor::Member(Session& session, std::string const& room, std::size_t bytes) {
+        if (rooms_.Member(room, &session))
+            return true;
+
+        Trace::Emit(Trace::Event::PublishRefused, session.Identifier(), bytes);
+        session.Send(std::make_shared<std::vector<std::byte> const>(Message::Leave(room).Serialize()), Priority::Control);
+        return false;
     }
 
+    bool Processor::Linkable(Session const& session) const {
+        auto const remote = session.Remote();
+        if (!remote)
+            return true;
+
+        auto const matches = [&remote](std::string const& address) {
+            asio::error_code ec;
+            auto const ip = asio::ip::make_address(address, ec);
+            return !ec && ip == *remote;
+        };
+
+        return std::ranges::any_of(options_.peers, [&](FederationPeer const& peer) { return matches(peer.address); }) ||
+               std::ranges::any_of(options_.linkFrom, matches);
+    }
+
+    void Processor::Replay(Session::Id origin, std::span<std::byte const> packet) {
+        std::shared_ptr<Session> session;
+        {
+            std::lock_guard lock(sessionsMutex_);
+            if (auto iter = sessions_.find(origin); iter != sessions_.end())
+                session = iter->second;
+        }
+
+        // A socket that's never opened makes a detached session, replies are built but never written
+        if (!session)
+            session = Register(origin, asio::ip::tcp::socket(service_));
+
+        Reader(*session, packet);
+    }
+
+    std::shared_ptr<Session> Processor::Register(Session::Id id, asio::ip::tcp::socket socket) {
+        auto session = std::make_shared<Session>(id, std::move(socket), options_.flow, options_.liveness, options_.limits, slabs_, Session::Callbacks{
+            .onPacket = std::bind_front(&Processor::Reader, this),
+            .onPressure = [this](Session&, bool congested) { Pressure(congested); },
+            .onClose = std::bind_front(&Processor::Closed, this),
+            .onSent = [this](Session&, OutgoingTransfer const& transfer, std::uint64_t bytes, bool failed) {
+                Report(TransferProgress{
+                    .id = transfer.Identifier(),
+                    .name = transfer.Name(),
+                    .room = transfer.Room(),
+                    .kind = transfer.Kind(),
+                    .bytes = bytes,
+                    .size = transfer.Size(),
+                    .outgoing = true,
+                    .done = failed || bytes >= transfer.Size(),
+                    .failed = failed,
+                    .path = {}
+                }, bytes >= OutgoingTransfer::ChunkSize ? bytes - OutgoingTransfer::ChunkSize : 0);
+            },
+            .onThrottle = [this](Session&, Throttle action) {
+                throttled_[static_cast<std::size_t>(action)].fetch_add(1, std::memory_order_relaxed);
+            }
+        }, capture_.get());
+
+        {
+            std::lock_guard lock(sessionsMutex_);
+            sessions_.emplace(session->Identifier(), session);
+            clocks_.try_emplace(session->Identifier());
+        }
+
+        // Every client starts out in the default room
+        if (mode_ == Mode::Server)
+            rooms_.Join(DefaultRoom, session.get());
+
+        return session;
+    }
+
+    constexpr std::array<Processor::Handler, MessageTypeCount> Processor::handlers_ = {
+        &Processor::Deliver,    // New
+        &Processor::Deliver,    // Acknowledge
+        &Processor::Deliver,    // Join
+        &Processor::Deliver,    // Leave
+        &Processor::Receive,    // Offer, see Transfer.hpp
+        &Processor::Receive,    // Chunk
+        &Processor::Clock,      // ClockProbe, see Clock.hpp
+        &Processor::Clock,      // ClockReply
+        &Processor::Federate,   // Link, see Relay.hpp
+        &Processor::Federate,   // Relay
+        &Processor::Heartbeat   // Heartbeat, see Session.hpp
+    };
+
     // If an incomming message was received
-    void Processor::Reader(asio::error_code ec, std::size_t bytes) {
-        // If the processor (server) detected a client disconnect
-        if (ec == asio::error::eof || ec == asio::error::interrupted) [[unlikely]] {
-            if (mode_ == Mode::Server)
-                socket_ = std::make_unique<asio::ip::tcp::socket>(service_);
-
-            onDisconnect_();
-        }
-        // Otherwise, we detected a message or something else from async_read_until
-        else [[likely]] {
-            // Incoming messages exist
-            if (bytes > 0) {
-                auto received = Chat::Message::Deserialize(buffer_);
-                onReceive_(received);
-                buffer_.clear();
-
-                // If the message we received was a new message, send an acknowledgment
-                if (received.Type() == Chat::MessageType::New) {
-                    auto const acknowledgement = received.Acknowledge();
-                    Transmit(acknowledgement);
+    void Processor::Reader(Session& session, std::span<std::byte const> packet) {
+        // A short initializer zero-fills the missing handlers, a type added without one would dispatch through a null pointer
+        static_assert(std::ranges::none_of(handlers_, [](Handler handler) { return handler == nullptr; }),
+                      "Every MessageType needs a handler in Processor::handlers_");
+
+        // Every type has its own packet layout, and its own handler
+        auto const type = static_cast<std::size_t>(packet[sizeof(std::uint32_t)]);
+        if (type >= handlers_.size()) [[unlikely]] {
+            Trace::Emit(Trace::Event::PacketRejected, session.Identifier(), packet.size());
+            session.Close();
+            return;
+        }
+
+        (this->*handlers_[type])(session, packet, static_cast<MessageType>(type));
+    }
+
+    void Processor::Deliver(Session& session, std::span<std::byte const> packet, MessageType) {
+        auto message = Chat::Message::Deserialize(packet);
+        if (!message) [[unlikely]] {
+            Trace::Emit(Trace::Event::PacketRejected, session.Identifier(), packet.size());
+            session.Close();
+            return;
+        }
+
+        auto const& received = *message;
+
+        switch (received.Type()) {
+            case MessageType::New: {
+                // Only members publish to a room, otherwise the client is told that it isn't one instead of being acknowledged
+                if (mode_ == Mode::Server && !Member(session, received.Room(), packet.size()))
+                    break;
+
+                // A retransmitted message is acknowledged again, since the first acknowledgement may be what was lost
+                bool const duplicate = !seen_.Insert(received.Identifier());
+                if (!duplicate)
+                    onReceive_(received);
+
+                // Send an acknowledgment back to where it came from
+                auto const acknowledgement = received.Acknowledge();
+                session.Send(std::make_shared<std::vector<std::byte> const>(acknowledgement.Serialize()), Priority::Control);
+
+                if (duplicate) {
+                    duplicates_.fetch_add(1, std::memory_order_relaxed);
+                    Trace::Emit(Trace::Event::MessageDuplicate, session.Identifier(), received.Identifier());
+                    break;
                 }
+
+                // The server forwards the received packet as-is to the rest of the room
+                if (mode_ == Mode::Server)
+                    Route(std::make_shared<std::vector<std::byte> const>(packet.begin(), packet.end()), received.Type(), received.Room(), &session);
+                break;
+            }
+
+            case MessageType::Acknowledge:
+                onReceive_(Corrected(session, received));
+                break;
+
+            // The server confirms a join by sending it back, and refuses one with a leave, a client only switches rooms once
+            // it's confirmed
+            case MessageType::Join:
+                if (mode_ == Mode::Client)
+                    onReceive_(received);
+                else if (rooms_.Join(received.Room(), &session))
+                    session.Send(std::make_shared<std::vector<std::byte> const>(packet.begin(), packet.end()), Priority::Control);
+                else
+                    session.Send(std::make_shared<std::vector<std::byte> const>(Message::Leave(received.Room()).Serialize()), Priority::Control);
+                break;
+
+            case MessageType::Leave:
+                if (mode_ == Mode::Client)
+                    onReceive_(received);
+                else
+                    rooms_.Leave(received.Room(), &session);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    void Processor::Receive(Session& session, std::span<std::byte const> packet, MessageType type) {
+        std::optional<TransferProgress> progress;
+        std::optional<std::string> room;
+        std::uint64_t previous = 0;
+
+        if (type == MessageType::Offer) {
+            auto const offer = DecodeOffer(packet);
+            if (!offer) {
+                session.Close();
+                return;
+            }
+
+            // A transfer is published to the room like a message, so only a member may offer one
+            if (mode_ == Mode::Server && !Member(session, offer->room, packet.size()))
+                return;
+
+            room = offer->room;
+            progress = incoming_.Open(*offer, session.Identifier());
+        }
+        else {
+            auto const chunk = DecodeChunk(packet);
+            if (!chunk) {
+                session.Close();
+                return;
+            }
+
+            // The room is needed for relaying, and is forgotten once the last chunk is written
+            room = incoming_.Room(chunk->id, session.Identifier());
+            previous = chunk->offset;
+            progress = incoming_.Write(*chunk, session.Identifier());
+        }
+
+        // Unknown transfers, such as ones that already failed, and duplicate offers are ignored
+        if (!progress)
+            return;
+
+        // The server relays the transfer as-is to the rest of the room
+        if (mode_ == Mode::Server && room && !progress->failed) {
+            Route(std::make_shared<std::vector<std::byte> const>(packet.begin(), packet.end()), type, *room, &session);
+        }
+
+        Report(*progress, previous);
+
+        // A completed paste is delivered as a regular message
+        if (progress->done && !progress->failed && progress->kind == TransferKind::Text) {
+            onReceive_(Message(MessageType::New, std::chrono::system_clock::now(), incoming_.TakeText(progress->id, session.Identifier()), progress->room));
+        }
+    }
+
+    void Processor::Federate(Session& session, std::span<std::byte const> packet, MessageType type) {
+        // Only servers link to each other
+        if (mode_ != Mode::Server) {
+            session.Close();
+            return;
+        }
+
+        bool linked = false;
+        {
+            std::lock_guard lock(sessionsMutex_);
+            linked = links_.contains(session.Identifier());
+        }
+
+        if (type == MessageType::Link) {
+            auto const node = DecodeLinkHello(packet);
+            if (!node) {
+                session.Close();
+                return;
+            }
+
+            // The accepting side learns that the connection is a link from the hello, and answers it, unless anyone could
+            // lift their rate limits and connection cap by sending one
+            if (!linked && !Linkable(session)) {
+                Trace::Emit(Trace::Event::LinkRefused, session.Identifier());
+                session.Close();
+                return;
+            }
+
+            if (!linked) {
+                Promote(session, std::nullopt);
+                session.Send(LinkHello(node_), Priority::Control);
+            }
+
+            {
+                std::lock_guard lock(sessionsMutex_);
+                links_[session.Identifier()].stats.node = *node;
+            }
+
+            Trace::Emit(Trace::Event::LinkEstablished, session.Identifier(), *node);
+            return;
+        }
+
+        // Clients can't relay
+        if (!linked || !DecodeRelay(packet, [&](RelayEntry const& entry) { Relayed(session.Identifier(), entry); })) {
+            Trace::Emit(Trace::Event::PacketRejected, session.Identifier(), packet.size());
+            session.Close();
+        }
+    }
+
+    void Processor::Relayed(Session::Id link, RelayEntry const& entry) {
+        auto& delivered = delivered_[entry.origin];
+
+        // Our own messages coming back, or messages already delivered through another link
+        if (entry.origin == node_ || entry.sequence <= delivered) {
+            std::lock_guard lock(sessionsMutex_);
+            if (auto iter = links_.find(link); iter != links_.end())
+                ++iter->second.stats.suppressed;
+            return;
+        }
+
+        // Every link is ordered, so the first copy of every message arrives in the order the origin relayed them
+        delivered = entry.sequence;
+
+        auto packet = std::make_shared<std::vector<std::byte> const>(entry.packet.begin(), entry.packet.end());
+        auto const type = static_cast<MessageType>((*packet)[sizeof(std::uint32_t)]);
+
+        // Only new messages are relayed, anything else is ignored but still forwarded,
+        // a message retransmitted to two different servers is only delivered by the first
+        if (type == MessageType::New) {
+            auto const message = Message::Deserialize(*packet);
+            if (message && seen_.Insert(message->Identifier())) {
+                onReceive_(*message);
+                rooms_.Publish(message->Room(), packet, nullptr);
+            }
+            else if (message)
+                duplicates_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::lock_guard lock(sessionsMutex_);
+        for (auto& [id, other] : links_) {
+            if (id == link)
+                ++other.stats.received;
+            else if (options_.forward)
+                Batch(id, other, entry);
+        }
+    }
+
+    void Processor::Relay(Packet const& packet) {
+        std::lock_guard lock(sessionsMutex_);
+        if (links_.empty())
+            return;
+
+        RelayEntry const entry{ .origin = node_, .sequence = ++sequence_, .packet = *packet, .raw = {} };
+        for (auto& [id, link] : links_)
+            Batch(id, link, entry);
+    }
+
+    void Processor::Batch(Session::Id id, Link& link, RelayEntry const& entry) {
+        bool const started = link.batch.Empty();
+
+        // Entries decoded from another batch are forwarded as-is
+        if (entry.raw.empty())
+            link.batch.Append(entry.origin, entry.sequence, entry.packet);
+        else
+            link.batch.Append(entry);
+
+        ++link.stats.relayed;
+
+        // A started batch is sent once the handlers that are already queued have run, so that every message published in
+        // the meantime shares the frame, a full batch is sent right away
+        if (link.batch.Size() >= RelayBatch::MaxSize)
+            Flush(id, link);
+        else if (started)
+            asio::post(service_, [this, id]{
+                std::lock_guard lock(sessionsMutex_);
+                if (auto iter = links_.find(id); iter != links_.end())
+                    Flush(id, iter->second);
+            });
+    }
+
+    void Processor::Flush(Session::Id id, Link& link) {
+        auto packet = link.batch.Take();
+        if (!packet)
+            return;
+
+        ++link.stats.batches;
+
+        // Sending only touches the session, so it's fine while holding sessionsMutex_, a batch is never dropped by the overflow
+        // policy, only by a link that's already closing
+        auto session = sessions_.find(id);
+        if (session == sessions_.end() || !session->second->Open()) {
+            ++link.stats.dropped;
+            return;
+        }
+
+        session->second->Send(std::move(packet), Priority::Bulk);
+    }
+
+    void Processor::Clock(Session& session, std::span<std::byte const> packet, MessageType type) {
+        auto const now = std::chrono::system_clock::now();
+
+        if (type == MessageType::ClockProbe) {
+            auto reply = ClockReply(packet, now);
+            if (!reply) {
+                session.Close();
+                return;
+            }
+
+            session.Send(std::move(reply), Priority::Control);
+            return;
+        }
+
+        auto const sample = DecodeClockReply(packet, now);
+        if (!sample) {
+            session.Close();
+            return;
+        }
+
+        std::optional<ClockEstimate> estimate;
+        bool settled = true;
+        {
+            std::lock_guard lock(sessionsMutex_);
+            if (auto iter = clocks_.find(session.Identifier()); iter != clocks_.end()) {
+                iter->second.Add(*sample);
+                estimate = iter->second.Estimate(session.Identifier());
+                settled = iter->second.Settled();
+            }
+        }
+
+        if (estimate) {
+            Trace::Emit(Trace::Event::ClockEstimated, estimate->session, estimate->offset.count(), estimate->drift,
+                        estimate->roundTrip.count());
+        }
+
+        if (!settled)
+            session.Send(ClockProbe(), Priority::Control);
+    }
+
+    void Processor::Heartbeat(Session& session, std::span<std::byte const> packet, MessageType) {
+        if (!session.Heartbeat(packet)) [[unlikely]] {
+            Trace::Emit(Trace::Event::PacketRejected, session.Identifier(), packet.size());
+            session.Close();
+        }
+    }
+
+    void Processor::Probe() {
+        clockTimer_.expires_after(options_.clockInterval);
+        clockTimer_.async_wait([this](asio::error_code ec) {
+            if (ec)
+                return;
+
+            for (auto& [id, session] : sessions_)
+                session->Send(ClockProbe(), Priority::Control);
+
+            Probe();
+        });
+    }
+
+    Message Processor::Corrected(Session const& session, Message const& acknowledgement) const {
+        std::lock_guard lock(sessionsMutex_);
+
+        auto iter = clocks_.find(session.Identifier());
+        if (iter == clocks_.end())
+            return acknowledgement;
+
+        return Message(MessageType::Acknowledge, iter->second.ToLocal(acknowledgement.Timestamp()), acknowledgement.Identifier());
+    }
+
+    void Processor::Report(TransferProgress const& progress, std::uint64_t previous) {
+        if (!options_.onTransfer)
+            return;
+
+        // Only whole percentages are reported, so large transfers don't flood the UI
+        auto const percent = [&](std::uint64_t bytes) { return progress.size == 0 ? 100 : bytes * 100 / progress.size; };
+        if (progress.done || previous == 0 || percent(previous) != percent(progress.bytes))
+            options_.onTransfer(progress);
+    }
+
+    void Processor::Closed(Session& session) {
+        rooms_.LeaveAll(&session);
+
+        // A lost link that we initiated is connected again
+        std::optional<std::size_t> reconnect;
+
+        for (auto const& aborted : incoming_.Abort(session.Identifier()))
+            Report(aborted, 0);
+
+        {
+            std::lock_guard lock(sessionsMutex_);
+            sessions_.erase(session.Identifier());
+            clocks_.erase(session.Identifier());
+
+            if (auto link = links_.find(session.Identifier()); link != links_.end()) {
+                reconnect = link->second.peer;
+                links_.erase(link);
             }
         }
 
-        Receive();
+        if (reconnect)
+            Reconnect(*reconnect);
+
+        // Sessions closed by the destructor aren't reported
+        {
+            std::lock_guard lock(flowMutex_);
+            if (stopping_)
+                return;
+        }
+
+        Trace::Emit(Trace::Event::Disconnected);
+        onDisconnect_();
+    }
+
+    void Processor::Pressure(bool congested) {
+        // Taken so that a producer can't miss the wakeup between checking its session and waiting
+        {
+            std::lock_guard lock(flowMutex_);
+        }
+
+        flowCv_.notify_all();
+
+        // Only a client's connection to the server blocks our own producers, a server's recipients are capped on the io thread,
+        // this may run with sessionsMutex_ held so it's not taken
+        if (mode_ == Mode::Client && options_.onBackpressure)
+            options_.onBackpressure(congested);
     }
 
     // Sends a new message
     void Processor::Transmit(Chat::Message const& message) {
-        // Serializes the message and attempt to send it
-        auto packet = message.Serialize();
-        asio::async_write(*socket_, asio::buffer(packet), []([[maybe_unused]] asio::error_code ec, std::size_t bytes) {
-            Misc::Debug("Transmitting {} bytes!\n", bytes);
+        // Serializes the message once, every connection shares the same packet
+        auto packet = std::make_shared<std::vector<std::byte> const>(message.Serialize());
+
+        // The io thread itself must never block, it's the one draining the queues
+        if (service_.get_executor().running_in_this_thread()) {
+            Route(packet, message.Type(), message.Room(), nullptr);
+            return;
+        }
+
+        // A client waits for its connection to the server, a server doesn't wait for any single recipient, a stalled one
+        // would hold up the rest of the room, Session::Overflowed caps its queue instead
+        if (options_.flow.policy == Overflow::Block && mode_ == Mode::Client) {
+            std::shared_ptr<Session> server;
+            {
+                std::lock_guard lock(sessionsMutex_);
+                if (!sessions_.empty())
+                    server = sessions_.begin()->second;
+            }
+
+            if (server) {
+                std::unique_lock lock(flowMutex_);
+                flowCv_.wait(lock, [this, &server]{ return !server->Congested() || stopping_; });
+            }
+        }
+
+        asio::post(service_, [this, packet = std::move(packet), type = message.Type(), room = message.Room()]{
+            Route(packet, type, room, nullptr);
+        });
+    }
+
+    void Processor::Route(Packet const& packet, MessageType type, std::string const& room, Session const* sender) {
+        // A client only has a single connection, the server
+        if (mode_ == Mode::Client) {
+            Broadcast(packet);
+            return;
+        }
+
+        // The server is implicitly a member of every room, so only new messages and transfers are routed, only new
+        // messages are federated, transfers stay on the server they were sent to
+        if (type == MessageType::New) {
+            rooms_.Publish(room, packet, sender);
+            Relay(packet);
+        }
+        else if (type == MessageType::Offer)
+            rooms_.Publish(room, packet, sender);
+        else if (type == MessageType::Chunk)
+            rooms_.Publish(room, packet, sender, Priority::Bulk);
+    }
+
+    std::uint64_t Processor::SendFile(std::filesystem::path const& path, std::string room) {
+        return Send(std::make_shared<OutgoingTransfer>(path, std::move(room)));
+    }
+
+    std::uint64_t Processor::SendText(std::string text, std::string room) {
+        return Send(std::make_shared<OutgoingTransfer>(std::move(text), std::move(room)));
+    }
+
+    std::uint64_t Processor::Send(std::shared_ptr<OutgoingTransfer> transfer) {
+        auto const id = transfer->Identifier();
+
+        // Every connection reads the shared source at its own pace
+        asio::post(service_, [this, transfer = std::move(transfer)]{
+            if (mode_ == Mode::Client) {
+                for (auto& [id, session] : sessions_)
+                    session->Attach(transfer);
+            }
+            else {
+                for (Session* member : rooms_.Members(transfer->Room()))
+                    member->Attach(transfer);
+            }
+        });
+
+        return id;
+    }
+
+    void Processor::Broadcast(Packet const& packet) {
+        // Sending never closes a session synchronously, so the map isn't modified while iterating
+        for (auto& [id, session] : sessions_)
+            session->Send(packet);
+    }
+
+    Processor::Statistics Processor::Stats() const {
+        Statistics stats;
+
+        std::lock_guard lock(sessionsMutex_);
+        stats.sessions.reserve(sessions_.size());
+
+        for (auto const& [id, session] : sessions_) {
+            stats.sessions.push_back(session->Stats());
+            stats.queuedBytes += stats.sessions.back().queuedBytes;
+        }
+
+        for (auto const& [id, clock] : clocks_) {
+            if (auto estimate = clock.Estimate(id))
+                stats.clocks.push_back(*estimate);
+        }
+
+        for (auto const& [id, link] : links_)
+            stats.links.push_back(link.stats);
+
+        if (mode_ == Mode::Server)
+            stats.rooms = rooms_.Stats();
+
+        stats.duplicates = duplicates_.load(std::memory_order_relaxed);
+        stats.receive = slabs_->Stats();
+        stats.throttle = ThrottleStats{
+            .delayed = throttled_[static_cast<std::size_t>(Throttle::Delay)].load(std::memory_order_relaxed),
+            .dropped = throttled_[static_cast<std::size_t>(Throttle::Drop)].load(std::memory_order_relaxed),
+            .disconnected = throttled_[static_cast<std::size_t>(Throttle::Disconnect)].load(std::memory_order_relaxed),
+            .rejected = rejected_.load(std::memory_order_relaxed),
+            .acceptsDelayed = acceptsDelayed_.load(std::memory_order_relaxed)
+        };
+        return stats;
+    }
+
+    void Processor::Drain() {
+        {
+            std::lock_guard lock(flowMutex_);
+            draining_ = true;
+        }
+
+        // The acceptor and the retry timers are only used on the io thread
+        asio::post(service_, [this] {
+            if (acceptor_ && acceptor_->is_open()) {
+                asio::error_code ignored;
+                acceptor_->close(ignored);
+            }
+
+            for (auto& timer : linkTimers_)
+                timer.cancel();
+
+            std::lock_guard lock(sessionsMutex_);
+            Trace::Emit(Trace::Event::ServerDraining, sessions_.size());
+        });
+    }
+
+    void Processor::Sample() {
+        statsTimer_.expires_after(options_.statsInterval);
+        statsTimer_.async_wait([this](asio::error_code ec) {
+            if (ec)
+                return;
+
+            rooms_.Sample();
+
+            auto const pool = slabs_->Stats();
+            Trace::Emit(Trace::Event::PoolSampled, pool.inUse, pool.cached, pool.peak);
+            Sample();
         });
     }
-}
\ No newline at end of file
+}
@@ -12,13 +12,74 @@
 #include "asio/executor_work_guard.hpp"
 #include "asio/ip/tcp.hpp"
 #include "Message.hpp"
+#include "Session.hpp"
+#include "Rooms.hpp"
+#include "Transfer.hpp"
+#include "Capture.hpp"
+#include "Clock.hpp"
+#include "Relay.hpp"
+#include "Duplicates.hpp"
+#include "Limits.hpp"
+#include "Pool.hpp"
+#include "asio/steady_timer.hpp"
 #include "../core/Mode.hpp"
+#include <array>
+#include <atomic>
 #include <memory>
 #include <functional>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
 
 
 namespace Chat {
+    /**
+     * @struct Chat::FederationPeer
+     * @brief Another server that a server links to, every message published on either is relayed to the other
+     * @author Noak Palander
+     */
+    struct FederationPeer {
+        std::string address;
+        int port;
+    };
+
+    /**
+     * @struct Chat::ProcessorOptions
+     * @brief Optional configuration of a Chat::Processor, shared by both modes
+     * @author Noak Palander
+     *
+     * Declared outside of the processor so that it can be used as a default argument of its constructors.
+     */
+    struct ProcessorOptions {
+        FlowControl flow;                               /**< Outbound backpressure of every connection */
+        Liveness liveness;                              /**< How every connection detects a vanished peer */
+        RateLimits limits;                              /**< The inbound rate limits of every client, links are exempt */
+        Admission admission;                            /**< Limits the connections accepted as a server */
+        std::function<void(bool)> onBackpressure;       /**< Invoked with true when a client's connection to the server congests, and false once it drained */
+        std::chrono::milliseconds statsInterval{10000}; /**< How often the server samples and traces the per-room rates */
+        std::function<void(TransferProgress const&)> onTransfer;    /**< Reports the progress of transfers in either direction */
+        std::filesystem::path downloads;                /**< Where received files are written, a client defaults to DefaultDownloads(), a server only stores what it relays when it's set */
+        std::uint64_t downloadQuota = 1024 * 1024 * 1024;   /**< The most bytes of files written to the downloads, failed transfers give theirs back, 0 is unlimited */
+        std::size_t maxTransfers = 32;                  /**< The most transfers received on a single connection at once, 0 is unlimited */
+        std::filesystem::path capture;                  /**< Records every frame sent and received to this file when set, see Capture.hpp */
+        std::chrono::milliseconds clockInterval{5000};  /**< How often every peer's clock is probed, after the initial burst */
+        std::vector<FederationPeer> peers;              /**< The servers a server links to, a link is only needed in one direction */
+        std::vector<std::string> linkFrom;              /**< Addresses besides those of the peers that may link to this server, every other link hello is refused */
+        std::chrono::milliseconds linkRetry{1000};      /**< How long to wait before a failed or lost link is connected again */
+        bool forward = true;                            /**< Forwards relayed messages to the other links, not needed in a full mesh */
+        std::size_t maxRooms = 4096;                    /**< The most rooms a server keeps at once, empty rooms are reclaimed, 0 is unlimited */
+        std::size_t maxJoins = 64;                      /**< The most rooms a single client is a member of at once, 0 is unlimited */
+        std::size_t dedupWindow = 8192;                 /**< How many recent message IDs are remembered to drop retransmitted duplicates, 0 disables it */
+        std::size_t receiveSlab = 16 * 1024;            /**< The size of the pooled receive buffers, larger frames are received into a chain of them */
+        std::size_t receiveSlabsCached = 64;            /**< How many free receive buffers are kept for reuse, shared by every connection */
+    };
+
     /**
      * @class Chat::Processor
      * @brief Contains the server or client, depending on what mode was passed
@@ -26,17 +87,36 @@ namespace Chat {
      */
     class Processor {
     public:
+        using Options = ProcessorOptions;
+
+        /**
+         * @struct Chat::Processor::Statistics
+         * @brief A snapshot of the processor's connections
+         */
+        struct Statistics {
+            std::vector<SessionStats> sessions;
+            std::size_t queuedBytes = 0;    /**< The sum of every connection's outbound queue */
+            std::vector<RoomStats> rooms;   /**< Only populated as a server */
+            std::vector<ClockEstimate> clocks;  /**< Every peer whose clock has been probed */
+            std::vector<LinkStats> links;       /**< Every link to another server */
+            std::uint64_t duplicates = 0;       /**< Messages dropped because they were already delivered */
+            PoolStats receive{};                /**< The occupancy of the receive buffers */
+            ThrottleStats throttle;             /**< How often the rate limits and the admission control were enforced */
+        };
+
         /**
-         * @brief Constructs a server
+         * @brief Constructs a server, it links to every server in Options::peers
          * @param port the port to be used
          * @param onReceive a callback that is invoked when a message is received
          * @param onConnected a callback that is invoked when a client connects
          * @param onConnectionLost a callback that is invoked when a client disonnects
+         * @param options optional configuration
          */
         Processor(int port,
                   std::function<void(Chat::Message const&)> onReceive,
                   std::function<void()> onConnected,
-                  std::function<void()> onConnectionLost);
+                  std::function<void()> onConnectionLost,
+                  Options options = {});
 
         /**
          * @brief Constructs a client
@@ -45,20 +125,73 @@ namespace Chat {
          * @param onReceive a callback that is invoked when a message is received
          * @param onConnected a callback that is invoked when the connection to the server is established
          * @param onConnectionLost a callback that is invoked if the connection to the server is lost
+         * @param options optional configuration
          */
         Processor(int port, std::string const& address,
                   std::function<void(Chat::Message const&)> onReceive,
                   std::function<void()> onConnected,
-                  std::function<void()> onConnectionLost);
+                  std::function<void()> onConnectionLost,
+                  Options options = {});
+
+        /**
+         * @brief Constructs an offline processor without any sockets or threads, packets are fed to it through Replay
+         * @param mode the configuration whose receive path should be replayed
+         * @param onReceive a callback that is invoked when a message is received
+         * @param options optional configuration
+         */
+        Processor(Mode mode, std::function<void(Chat::Message const&)> onReceive, Options options = {});
 
         ~Processor();
 
+        /**
+         * @brief Feeds a captured packet through the receive path, exactly as if it was received on a connection
+         * @param origin the session it was received on, sessions are created on first use and discard what they're sent
+         * @param packet the packet, including its length prefix
+         * @attention Only valid for an offline processor, every call must be made from the same thread
+         */
+        void Replay(Session::Id origin, std::span<std::byte const> packet);
+
         /**
          * @brief Broadcasts a message to the recipient, can be used in both configurations
          * @param message the message that should be sent the server/client
+         *
+         * As a server, new messages are only sent to the members of the message's room, and relayed to every linked server,
+         * while Join/Leave are ignored since the server itself sees every room. With Overflow::Block, a client's call from outside
+         * of the io thread blocks while its connection to the server is congested.
          */
         void Transmit(Chat::Message const& message);
 
+        /**
+         * @brief Sends a file in chunks, interleaved with the chat traffic, the file is read as the connections drain
+         * @param path the file to send
+         * @param room the room to send it to, as a server
+         * @return the identifier of the transfer, used in the progress reports
+         * @throws std::system_error if the file can't be opened
+         */
+        std::uint64_t SendFile(std::filesystem::path const& path, std::string room);
+
+        /**
+         * @brief Sends a large paste in chunks, interleaved with the chat traffic, it's received as a regular new message
+         * @param text the contents
+         * @param room the room to send it to
+         * @return the identifier of the transfer, used in the progress reports
+         */
+        std::uint64_t SendText(std::string text, std::string room);
+
+        /**
+         * @brief Can be called from any thread
+         * @return a snapshot of every connection's outbound queue
+         */
+        [[nodiscard]] Statistics Stats() const;
+
+        /**
+         * @brief Stops accepting connections and connecting links again, the open connections keep sending their queues
+         *
+         * Can be called from any thread, it returns right away. Wait for Stats().queuedBytes to reach 0 before
+         * destroying the processor, to shut down without dropping anything that was already queued.
+         */
+        void Drain();
+
     private:
         /**
          * @brief Internal, starts to accept clients, can only be used as a server
@@ -67,29 +200,256 @@ namespace Chat {
 
         /**
          * @brief Internal, is invoked when a client connects
-         * @param ec an error code provided by asio::async_connect
+         * @param ec an error code provided by asio::async_accept
+         * @param socket the accepted socket
+         */
+        void HandleAccept(asio::error_code ec, asio::ip::tcp::socket socket);
+
+        /**
+         * @brief Internal, wraps a connected socket in a session and starts receiving, can be used in both configurations
+         * @param socket the connected socket
+         * @return the session
+         */
+        std::shared_ptr<Session> Open(asio::ip::tcp::socket socket);
+
+        /**
+         * @brief Internal, connects a link to another server, only used as a server
+         * @param peer the index of the server in Options::peers
+         */
+        void Connect(std::size_t peer);
+
+        /**
+         * @brief Internal, connects a link again after Options::linkRetry
+         * @param peer the index of the server in Options::peers
+         */
+        void Reconnect(std::size_t peer);
+
+        /**
+         * @brief Internal, whether links are still connected, they aren't once stopping or draining
+         */
+        [[nodiscard]] bool Linking();
+
+        /**
+         * @brief Internal, turns a session into a link, it leaves every room and receives the relayed messages instead
+         * @param session the session
+         * @param peer the index of the server in Options::peers, if we initiated the link
+         */
+        void Promote(Session& session, std::optional<std::size_t> peer);
+
+        /**
+         * @brief Internal, whether a session may publish to a room, one that isn't a member is sent a leave of the room instead
+         * @param session the publishing session
+         * @param room the room it publishes to
+         * @param bytes the size of what it publishes, traced when it's refused
+         */
+        bool Member(Session& session, std::string const& room, std::size_t bytes);
+
+        /**
+         * @brief Internal, whether a session that sent a link hello may become a link, a link is unlimited and doesn't count
+         * as a client, so only the peers and Options::linkFrom may link to a server
+         * @param session the session, a detached one is replaying a capture and is always allowed
+         */
+        [[nodiscard]] bool Linkable(Session const& session) const;
+
+        /**
+         * @brief Internal, handles a hello or a relayed batch
+         * @param session the connection the packet was received on
+         * @param packet the received packet
+         * @param type either MessageType::Link or MessageType::Relay
+         */
+        void Federate(Session& session, std::span<std::byte const> packet, MessageType type);
+
+        /**
+         * @brief Internal, delivers a relayed message unless it was already seen, and forwards it to the other links
+         * @param link the link it was received on
+         * @param entry the relayed message
+         */
+        void Relayed(Session::Id link, RelayEntry const& entry);
+
+        /**
+         * @brief Internal, relays a message published on this server to every link
+         * @param packet the serialized message
+         */
+        void Relay(Packet const& packet);
+
+        struct Link;
+
+        /**
+         * @brief Internal, appends a message to the batch of a link, must be called with sessionsMutex_ held
+         * @param id the link
+         * @param link the state of the link
+         * @param entry the message, it's forwarded as-is if it was decoded from another batch
+         */
+        void Batch(Session::Id id, Link& link, RelayEntry const& entry);
+
+        /**
+         * @brief Internal, sends the batch of a link, must be called with sessionsMutex_ held
+         * @param id the link
+         * @param link the state of the link
+         */
+        void Flush(Session::Id id, Link& link);
+
+        /**
+         * @brief Internal, creates a session and subscribes it to the default room as a server, without starting it
+         * @param id the identifier of the session
+         * @param socket the connected socket, or a socket that was never opened for a detached session
+         * @return the session
          */
-        void HandleAccept(asio::error_code ec);
+        std::shared_ptr<Session> Register(Session::Id id, asio::ip::tcp::socket socket);
 
         /**
-         * @brief Internal, starts to receive incoming data, can be used in both configurations
+         * @brief Internal, is invoked when a packet was received, dispatches it to the handler of its type
+         * @param session the connection the packet was received on
+         * @param packet the received packet
          */
-        void Receive();
+        void Reader(Session& session, std::span<std::byte const> packet);
 
         /**
-         * @brief Internal, is invoked when a message was received
-         * @param ec an error code provided by asio::async_read_until
-         * @param bytes the number of bytes received
+         * @brief Internal, handles a received packet of the types it's registered for in handlers_
          */
-        void Reader(asio::error_code ec, std::size_t bytes);
+        using Handler = void (Processor::*)(Session& session, std::span<std::byte const> packet, MessageType type);
+
+        /**
+         * @brief Internal, the handler of every message type, indexed by the type byte, a new type that isn't added to it fails to compile
+         */
+        static std::array<Handler, MessageTypeCount> const handlers_;
+
+        /**
+         * @brief Internal, handles a received Chat::Message
+         * @param session the connection the packet was received on
+         * @param packet the received packet
+         * @param type New, Acknowledge, Join or Leave
+         */
+        void Deliver(Session& session, std::span<std::byte const> packet, MessageType type);
+
+        /**
+         * @brief Internal, queues a packet on every connection, must be invoked on the io thread
+         * @param packet the packet to queue
+         */
+        void Broadcast(Packet const& packet);
+
+        /**
+         * @brief Internal, queues a packet on the connections it's addressed to, must be invoked on the io thread
+         * @param packet the packet to queue
+         * @param type the type of the serialized message
+         * @param room the room of the serialized message
+         * @param sender the connection the message was received on, it won't receive it back, null if it's our own message
+         */
+        void Route(Packet const& packet, MessageType type, std::string const& room, Session const* sender);
+
+        /**
+         * @brief Internal, periodically samples the per-room message rates, only used as a server
+         */
+        void Sample();
+
+        /**
+         * @brief Internal, queues a transfer on the connections it's addressed to
+         * @param transfer the transfer to send
+         * @return the identifier of the transfer
+         */
+        std::uint64_t Send(std::shared_ptr<OutgoingTransfer> transfer);
+
+        /**
+         * @brief Internal, handles a received offer or chunk
+         * @param session the connection the packet was received on
+         * @param packet the received packet
+         * @param type either MessageType::Offer or MessageType::Chunk
+         */
+        void Receive(Session& session, std::span<std::byte const> packet, MessageType type);
+
+        /**
+         * @brief Internal, answers a clock probe, or adds the sample of a reply to the peer's estimate
+         * @param session the connection the packet was received on
+         * @param packet the received packet
+         * @param type either MessageType::ClockProbe or MessageType::ClockReply
+         */
+        void Clock(Session& session, std::span<std::byte const> packet, MessageType type);
+
+        /**
+         * @brief Internal, hands a heartbeat to the session it was received on, which answers it or samples the round trip
+         * @param session the connection the packet was received on
+         * @param packet the received packet
+         */
+        void Heartbeat(Session& session, std::span<std::byte const> packet, MessageType);
+
+        /**
+         * @brief Internal, periodically probes the clock of every peer
+         */
+        void Probe();
+
+        /**
+         * @brief Internal, converts the timestamp of an acknowledgement from the peer's clock into ours
+         * @param session the connection the acknowledgement was received on
+         * @param acknowledgement the received acknowledgement
+         * @return the acknowledgement, stamped in our clock once the peer's clock is known
+         */
+        Message Corrected(Session const& session, Message const& acknowledgement) const;
+
+        /**
+         * @brief Internal, forwards the progress of a transfer, throttled to whole percentages
+         * @param progress the current progress
+         * @param previous the number of bytes at the previous report
+         */
+        void Report(TransferProgress const& progress, std::uint64_t previous);
+
+        /**
+         * @brief Internal, is invoked when a connection crosses one of its watermarks, wakes up the producers waiting for it
+         * @param congested true if the high watermark was crossed, false if it drained below the low watermark
+         */
+        void Pressure(bool congested);
+
+        /**
+         * @brief Internal, is invoked once a connection is closed
+         * @param session the closed connection
+         */
+        void Closed(Session& session);
+
+        /**
+         * @brief Internal, starts the io_service on the background thread
+         */
+        void Run();
 
         Mode mode_;                                                           /**< the current configuration */
-        std::vector<std::byte> buffer_;                                       /**< The packet buffer for receiving data */
+        Options options_;                                                     /**< the optional configuration */
         std::jthread runner_;                                                 /**< Starts the io_service on a background thread */
 
         asio::io_service service_;                                            /**< the io service that handles async events */
-        std::unique_ptr<asio::ip::tcp::socket> socket_;                       /**< pointer to a tcp socket */
         std::unique_ptr<asio::ip::tcp::acceptor> acceptor_;                   /**< pointer to an acceptor for the server */
+        asio::steady_timer statsTimer_{service_};                             /**< drives Sample */
+        asio::steady_timer clockTimer_{service_};                             /**< drives Probe */
+        Rooms rooms_{options_.maxRooms, options_.maxJoins};                   /**< the room subscriptions, only used as a server */
+        IncomingTransfers incoming_;                                          /**< transfers being received, only used on the io thread */
+        std::unique_ptr<Capture> capture_;                                    /**< records every frame when options_.capture is set */
+        DuplicateFilter seen_;                                                /**< the recently delivered messages, only used on the io thread */
+        std::atomic<std::uint64_t> duplicates_ = 0;                           /**< the number of duplicates dropped, read by Stats */
+        std::shared_ptr<SlabPool> slabs_;                                     /**< the receive buffers of every session, shared with them */
+        asio::steady_timer acceptTimer_{service_};                            /**< resumes accepting once the accept rate allows it */
+        std::vector<asio::steady_timer> linkTimers_;                          /**< one per peer, drives Reconnect, cancelled by Drain */
+        TokenBucket accepts_;                                                 /**< the accept rate, only used on the io thread */
+        std::array<std::atomic<std::uint64_t>, 3> throttled_{};               /**< the number of times every Throttle action was taken */
+        std::atomic<std::uint64_t> rejected_ = 0;                             /**< connections closed above Admission::maxConnections */
+        std::atomic<std::uint64_t> acceptsDelayed_ = 0;                       /**< times accepting paused on the accept rate */
+
+        mutable std::mutex sessionsMutex_;                                    /**< guards sessions_, clocks_ and links_ against readers outside of the io thread */
+        std::unordered_map<Session::Id, std::shared_ptr<Session>> sessions_;  /**< every open connection, at most one as a client */
+        std::unordered_map<Session::Id, PeerClock> clocks_;                   /**< the clock estimate of every open connection */
+
+        struct Link {
+            LinkStats stats;
+            RelayBatch batch;
+            std::optional<std::size_t> peer;                                  /**< set if we initiated the link, it's connected again if lost */
+        };
+
+        std::unordered_map<Session::Id, Link> links_;                         /**< every link to another server, guarded by sessionsMutex_ */
+        std::unordered_map<std::uint64_t, std::uint64_t> delivered_;          /**< the last sequence delivered from every origin node */
+        std::uint64_t node_;                                                  /**< our node ID, random for every run so sequences restart safely */
+        std::uint64_t sequence_ = 0;                                          /**< the sequence of the last message we relayed */
+        Session::Id nextSession_ = 0;
+
+        std::mutex flowMutex_;                                                /**< guards stopping_ and draining_, and waiting for a congested connection */
+        std::condition_variable flowCv_;                                      /**< signalled when a connection drains, or when stopping */
+        bool stopping_ = false;
+        bool draining_ = false;                                               /**< set by Drain, links aren't connected again */
 
         // Event callbacks for the UI
         std::function<void(Chat::Message const&)> onReceive_;
@@ -0,0 +1,109 @@
+/**
+ * @file Relay.cpp
+ * @brief Implements the relayed frames of federated servers
+ * @author Noak Palander
+ * @version 1.0
+ * @see Relay.hpp
+ */
+
+#include "Relay.hpp"
+
+#include "Wire.hpp"
+
+namespace Chat {
+    namespace {
+        constexpr std::size_t BatchHeader = sizeof(std::uint32_t) + 1 + sizeof(std::uint32_t);
+        constexpr std::size_t EntryHeader = sizeof(std::uint64_t) * 2;
+        constexpr std::size_t HelloSize = sizeof(std::uint32_t) + 1 + sizeof(std::uint64_t);
+
+        template<Wire::Field T>
+        void Put(std::vector<std::byte>& buffer, T value) {
+            auto const offset = buffer.size();
+            buffer.resize(offset + sizeof(T));
+            Wire::Store(buffer.data() + offset, value);
+        }
+    }
+
+    void RelayBatch::Append(std::uint64_t origin, std::uint64_t sequence, std::span<std::byte const> packet) {
+        // The header is filled in by Take
+        if (buffer_.empty())
+            buffer_.resize(BatchHeader);
+
+        Put(buffer_, origin);
+        Put(buffer_, sequence);
+        buffer_.insert(buffer_.end(), packet.begin(), packet.end());
+        ++count_;
+    }
+
+    void RelayBatch::Append(RelayEntry const& entry) {
+        if (buffer_.empty())
+            buffer_.resize(BatchHeader);
+
+        buffer_.insert(buffer_.end(), entry.raw.begin(), entry.raw.end());
+        ++count_;
+    }
+
+    Packet RelayBatch::Take() {
+        if (count_ == 0)
+            return nullptr;
+
+        auto const length = static_cast<std::uint32_t>(buffer_.size() - sizeof(std::uint32_t));
+        Wire::Store(buffer_.data(), length);
+        Wire::Store(buffer_.data() + sizeof(std::uint32_t), MessageType::Relay);
+        Wire::Store(buffer_.data() + sizeof(std::uint32_t) + 1, count_);
+
+        auto packet = std::make_shared<std::vector<std::byte> const>(std::move(buffer_));
+        buffer_ = {};
+        count_ = 0;
+        return packet;
+    }
+
+    Packet LinkHello(std::uint64_t node) {
+        std::vector<std::byte> packet;
+        packet.reserve(HelloSize);
+
+        Put(packet, static_cast<std::uint32_t>(HelloSize - sizeof(std::uint32_t)));
+        Put(packet, MessageType::Link);
+        Put(packet, node);
+        return std::make_shared<std::vector<std::byte> const>(std::move(packet));
+    }
+
+    std::optional<std::uint64_t> DecodeLinkHello(std::span<std::byte const> packet) {
+        if (packet.size() != HelloSize)
+            return std::nullopt;
+
+        return Wire::Load<std::uint64_t>(packet.data() + sizeof(std::uint32_t) + 1);
+    }
+
+    bool DecodeRelay(std::span<std::byte const> packet, std::function<void(RelayEntry const&)> const& visitor) {
+        if (packet.size() < BatchHeader)
+            return false;
+
+        auto const count = Wire::Load<std::uint32_t>(packet.data() + sizeof(std::uint32_t) + 1);
+
+        std::span<std::byte const> remaining = std::span(packet).subspan(BatchHeader);
+
+        for (std::uint32_t i = 0; i < count; ++i) {
+            // Every entry must hold its header, and a complete packet with a type byte
+            if (remaining.size() < EntryHeader + sizeof(std::uint32_t) + 1)
+                return false;
+
+            RelayEntry entry{};
+            entry.origin = Wire::Load<std::uint64_t>(remaining.data());
+            entry.sequence = Wire::Load<std::uint64_t>(remaining.data() + sizeof(std::uint64_t));
+            auto const length = Wire::Load<std::uint32_t>(remaining.data() + EntryHeader);
+
+            std::size_t const size = EntryHeader + sizeof(std::uint32_t) + length;
+            if (length == 0 || remaining.size() < size)
+                return false;
+
+            entry.packet = remaining.subspan(EntryHeader, sizeof(std::uint32_t) + length);
+            entry.raw = remaining.first(size);
+            visitor(entry);
+
+            remaining = remaining.subspan(size);
+        }
+
+        return remaining.empty();
+    }
+}
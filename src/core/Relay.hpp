@@ -0,0 +1,112 @@
+/**
+ * @file Relay.hpp
+ * @brief Contains the batched frames that federated servers relay messages to each other with
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * A link starts with a hello in each direction: 4B = length, 1B = type (Link), 8B = node ID.
+ * Messages are then relayed in batches: 4B = length, 1B = type (Relay), 4B = number of entries, followed by the entries,
+ * 8B = origin node ID, 8B = sequence number at the origin, xB = the relayed packet, including its length prefix.
+ */
+
+#ifndef CHATAPP_RELAY_HPP
+#define CHATAPP_RELAY_HPP
+
+#include "Message.hpp"
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @struct Chat::LinkStats
+     * @brief A snapshot of a link to another federated server
+     * @author Noak Palander
+     */
+    struct LinkStats {
+        std::uint32_t session;
+        std::uint64_t node;             /**< The node ID of the peer, 0 until its hello is received */
+        std::uint64_t relayed;          /**< Entries queued on the link */
+        std::uint64_t batches;          /**< Frames the entries were batched into */
+        std::uint64_t dropped;          /**< Batches that couldn't be sent because the link was closing */
+        std::uint64_t received;         /**< New entries received on the link */
+        std::uint64_t suppressed;       /**< Entries received that were already seen, or that originated here */
+    };
+
+    /**
+     * @struct Chat::RelayEntry
+     * @brief A single relayed packet, refers into the batch it was decoded from
+     * @author Noak Palander
+     */
+    struct RelayEntry {
+        std::uint64_t origin;                   /**< The node the message was first published on */
+        std::uint64_t sequence;                 /**< Increases by one for every message the origin relays */
+        std::span<std::byte const> packet;      /**< The relayed packet, including its length prefix */
+        std::span<std::byte const> raw;         /**< The whole entry, forwarded as-is to other links */
+    };
+
+    /**
+     * @class Chat::RelayBatch
+     * @brief Accumulates the entries relayed on a link until it's flushed as a single frame
+     * @author Noak Palander
+     */
+    class RelayBatch {
+    public:
+        /**
+         * @brief A batch this large is flushed right away instead of waiting for the io thread to go idle
+         */
+        static constexpr std::size_t MaxSize = 256 * 1024;
+
+        /**
+         * @brief Appends an entry
+         * @param origin the node the message was first published on
+         * @param sequence the sequence number at the origin
+         * @param packet the packet, including its length prefix
+         */
+        void Append(std::uint64_t origin, std::uint64_t sequence, std::span<std::byte const> packet);
+
+        /**
+         * @brief Appends an entry that was decoded from another batch, unchanged
+         * @param entry the decoded entry
+         */
+        void Append(RelayEntry const& entry);
+
+        [[nodiscard]] bool Empty() const noexcept { return count_ == 0; }
+        [[nodiscard]] std::size_t Size() const noexcept { return buffer_.size(); }
+
+        /**
+         * @brief Completes the frame and starts a new batch
+         * @return the frame, or null if the batch is empty
+         */
+        [[nodiscard]] Packet Take();
+
+    private:
+        std::vector<std::byte> buffer_;
+        std::uint32_t count_ = 0;
+    };
+
+    /**
+     * @param node our node ID
+     * @return the hello sent when a link is established
+     */
+    [[nodiscard]] Packet LinkHello(std::uint64_t node);
+
+    /**
+     * @brief Decodes a hello
+     * @param packet the received packet
+     * @return the node ID of the peer, or nothing if it's malformed
+     */
+    [[nodiscard]] std::optional<std::uint64_t> DecodeLinkHello(std::span<std::byte const> packet);
+
+    /**
+     * @brief Decodes every entry of a relayed batch
+     * @param packet the received packet
+     * @param visitor invoked for every entry, in order
+     * @return false if the batch is malformed, entries before the malformed one have been visited
+     */
+    bool DecodeRelay(std::span<std::byte const> packet, std::function<void(RelayEntry const&)> const& visitor);
+}
+
+#endif // CHATAPP_RELAY_HPP
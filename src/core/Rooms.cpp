@@ -0,0 +1,212 @@
+/**
+ * @file Rooms.cpp
+ * @brief Implements the Chat::Rooms class
+ * @author Noak Palander
+ * @version 1.0
+ * @see Rooms.hpp
+ */
+
+#include "Rooms.hpp"
+
+#include "Trace.hpp"
+#include <algorithm>
+
+namespace Chat {
+    Rooms::Rooms(std::size_t maxRooms, std::size_t maxJoins)
+        :   maxRooms_{maxRooms},
+            maxJoins_{maxJoins}
+    {}
+
+    std::optional<Rooms::Id> Rooms::Join(std::string_view name, Session* session) {
+        std::lock_guard lock(mutex_);
+
+        auto& rooms = memberships_[session];
+        auto iter = index_.find(name);
+
+        // Joining twice keeps a single membership
+        if (iter != index_.end() && std::find(rooms.begin(), rooms.end(), iter->second) != rooms.end())
+            return iter->second;
+
+        // Every room is created by a client, both limits keep a client from exhausting memory with unique names
+        if ((maxJoins_ > 0 && rooms.size() >= maxJoins_) || (iter == index_.end() && maxRooms_ > 0 && index_.size() >= maxRooms_)) {
+            Trace::Emit(Trace::Event::RoomRefused, session->Identifier(), rooms.size(), index_.size());
+
+            if (rooms.empty())
+                memberships_.erase(session);
+            return std::nullopt;
+        }
+
+        if (iter == index_.end()) {
+            Id id = static_cast<Id>(rooms_.size());
+            if (!vacant_.empty()) {
+                id = vacant_.back();
+                vacant_.pop_back();
+                rooms_[id] = Room{ .name = std::string(name), .members = {} };
+            }
+            else
+                rooms_.push_back(Room{ .name = std::string(name), .members = {} });
+
+            iter = index_.emplace(std::string(name), id).first;
+        }
+
+        Id const id = iter->second;
+        rooms.push_back(id);
+        rooms_[id].members.push_back(session);
+        Trace::Emit(Trace::Event::RoomJoined, session->Identifier(), id, rooms_[id].members.size());
+
+        return id;
+    }
+
+    void Rooms::Leave(std::string_view name, Session* session) {
+        std::lock_guard lock(mutex_);
+
+        auto iter = index_.find(name);
+        if (iter == index_.end())
+            return;
+
+        Id const id = iter->second;
+        if (Remove(rooms_[id], session)) {
+            if (auto memberships = memberships_.find(session); memberships != memberships_.end()) {
+                std::erase(memberships->second, id);
+                if (memberships->second.empty())
+                    memberships_.erase(memberships);
+            }
+
+            if (rooms_[id].members.empty())
+                Reclaim(id);
+        }
+    }
+
+    void Rooms::LeaveAll(Session* session) {
+        std::lock_guard lock(mutex_);
+
+        auto memberships = memberships_.find(session);
+        if (memberships == memberships_.end())
+            return;
+
+        for (Id const id : memberships->second) {
+            if (Remove(rooms_[id], session) && rooms_[id].members.empty())
+                Reclaim(id);
+        }
+
+        memberships_.erase(memberships);
+    }
+
+    bool Rooms::Remove(Room& room, Session* session) {
+        auto iter = std::find(room.members.begin(), room.members.end(), session);
+        if (iter == room.members.end())
+            return false;
+
+        // The order of the members doesn't matter, swap and pop keeps the vector dense
+        *iter = room.members.back();
+        room.members.pop_back();
+
+        Trace::Emit(Trace::Event::RoomLeft, session->Identifier(), static_cast<Id>(&room - rooms_.data()), room.members.size());
+        return true;
+    }
+
+    void Rooms::Reclaim(Id id) {
+        auto& room = rooms_[id];
+        index_.erase(room.name);
+
+        // The name and the member vector are released, only the slot is kept
+        room = Room{ .name = {}, .vacant = true, .members = {} };
+        vacant_.push_back(id);
+    }
+
+    Rooms::Room* Rooms::Find(std::string_view name) {
+        auto iter = index_.find(name);
+        return iter == index_.end() ? nullptr : &rooms_[iter->second];
+    }
+
+    bool Rooms::Member(std::string_view name, Session* session) const {
+        std::lock_guard lock(mutex_);
+
+        // A session is in a handful of rooms, while a room may have thousands of members
+        auto const room = index_.find(name);
+        auto const memberships = memberships_.find(session);
+        return room != index_.end() && memberships != memberships_.end() &&
+               std::find(memberships->second.begin(), memberships->second.end(), room->second) != memberships->second.end();
+    }
+
+    std::size_t Rooms::Publish(std::string_view name, Packet const& packet, Session const* except, Priority priority) {
+        std::lock_guard lock(mutex_);
+
+        Room* room = Find(name);
+        if (!room)
+            return 0;
+
+        ++room->messages;
+        room->bytes += packet->size();
+
+        // Every member shares the same serialized packet
+        std::size_t queued = 0;
+        for (Session* member : room->members) {
+            if (member == except)
+                continue;
+
+            member->Send(packet, priority);
+            ++queued;
+        }
+
+        return queued;
+    }
+
+    std::vector<Session*> Rooms::Members(std::string_view name) {
+        std::lock_guard lock(mutex_);
+
+        Room const* room = Find(name);
+        return room ? room->members : std::vector<Session*>{};
+    }
+
+    void Rooms::Sample() {
+        std::lock_guard lock(mutex_);
+
+        auto const now = std::chrono::steady_clock::now();
+        double const elapsed = std::chrono::duration<double>(now - sampled_).count();
+        sampled_ = now;
+
+        if (elapsed <= 0.0)
+            return;
+
+        for (auto& room : rooms_) {
+            if (room.vacant)
+                continue;
+
+            room.messagesPerSecond = static_cast<double>(room.messages - room.sampledMessages) / elapsed;
+            room.bytesPerSecond = static_cast<double>(room.bytes - room.sampledBytes) / elapsed;
+            room.sampledMessages = room.messages;
+            room.sampledBytes = room.bytes;
+
+            if (room.messagesPerSecond > 0.0) {
+                Trace::Emit(Trace::Event::RoomRate, static_cast<Id>(&room - rooms_.data()), room.members.size(),
+                            room.messagesPerSecond, room.bytesPerSecond);
+            }
+        }
+    }
+
+    std::vector<RoomStats> Rooms::Stats() const {
+        std::lock_guard lock(mutex_);
+
+        std::vector<RoomStats> stats;
+        stats.reserve(index_.size());
+
+        for (std::size_t i = 0; i < rooms_.size(); ++i) {
+            auto const& room = rooms_[i];
+            if (room.vacant)
+                continue;
+
+            stats.push_back(RoomStats{
+                .id = static_cast<Id>(i),
+                .name = room.name,
+                .members = room.members.size(),
+                .messages = room.messages,
+                .bytes = room.bytes,
+                .messagesPerSecond = room.messagesPerSecond,
+                .bytesPerSecond = room.bytesPerSecond
+            });
+        }
+
+        return stats;
+    }
+}
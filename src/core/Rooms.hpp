@@ -0,0 +1,159 @@
+/**
+ * @file Rooms.hpp
+ * @brief Contains the declaration of the Chat::Rooms class, which routes messages to the subscribers of a named room
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_ROOMS_HPP
+#define CHATAPP_ROOMS_HPP
+
+#include "Session.hpp"
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @struct Chat::RoomStats
+     * @brief A snapshot of a room's membership and traffic
+     * @author Noak Palander
+     */
+    struct RoomStats {
+        std::uint32_t id;
+        std::string name;
+        std::size_t members;
+        std::uint64_t messages;             /**< Messages published since the room was created, it's reclaimed once its last member leaves */
+        std::uint64_t bytes;                /**< Bytes published since the room was created, not multiplied by the fan-out */
+        double messagesPerSecond;           /**< Over the last sampling interval */
+        double bytesPerSecond;              /**< Over the last sampling interval */
+    };
+
+    /**
+     * @class Chat::Rooms
+     * @brief Keeps the members of every room in a dense vector, so that publishing is a single loop queuing one shared packet
+     * @author Noak Palander
+     *
+     * The sessions aren't owned, a session must leave every room (LeaveAll) before it's destroyed.
+     * Every member function is synchronized, but publishing is expected to happen on the io thread.
+     * A room is reclaimed when its last member leaves, and its identifier is reused by the next room created.
+     */
+    class Rooms {
+    public:
+        using Id = std::uint32_t;
+
+        /**
+         * @param maxRooms the most rooms that exist at once, 0 is unlimited
+         * @param maxJoins the most rooms a single session is a member of, 0 is unlimited
+         */
+        Rooms(std::size_t maxRooms, std::size_t maxJoins);
+
+        /**
+         * @brief Subscribes a session to a room, the room is created if it doesn't exist
+         * @param name the name of the room
+         * @param session the session to subscribe
+         * @return the identifier of the room, or nothing if either limit was reached
+         */
+        std::optional<Id> Join(std::string_view name, Session* session);
+
+        /**
+         * @brief Unsubscribes a session from a room, does nothing if it isn't a member
+         * @param name the name of the room
+         * @param session the session to unsubscribe
+         */
+        void Leave(std::string_view name, Session* session);
+
+        /**
+         * @brief Unsubscribes a session from every room it's a member of
+         * @param session the session to unsubscribe
+         */
+        void LeaveAll(Session* session);
+
+        /**
+         * @param name the name of the room
+         * @param session the session
+         * @return whether the session is a member of the room
+         */
+        [[nodiscard]] bool Member(std::string_view name, Session* session) const;
+
+        /**
+         * @brief Queues a packet on every member of a room
+         * @param name the name of the room
+         * @param packet the serialized message
+         * @param except a member that shouldn't receive it (the sender), can be null
+         * @param priority the outbound queue of every member to place it in
+         * @return the number of sessions the packet was queued on
+         */
+        std::size_t Publish(std::string_view name, Packet const& packet, Session const* except, Priority priority = Priority::Chat);
+
+        /**
+         * @param name the name of the room
+         * @return a snapshot of the room's members, empty if it doesn't exist
+         */
+        [[nodiscard]] std::vector<Session*> Members(std::string_view name);
+
+        /**
+         * @brief Updates the message rates of every room, based on the traffic since the previous sample
+         */
+        void Sample();
+
+        /**
+         * @return a snapshot of every room
+         */
+        [[nodiscard]] std::vector<RoomStats> Stats() const;
+
+    private:
+        struct Room {
+            std::string name;
+            bool vacant = false;                /**< Reclaimed, the slot is reused by the next room created */
+            std::vector<Session*> members;
+            std::uint64_t messages = 0;
+            std::uint64_t bytes = 0;
+
+            // Counters at the previous sample, used to derive the rates
+            std::uint64_t sampledMessages = 0;
+            std::uint64_t sampledBytes = 0;
+            double messagesPerSecond = 0.0;
+            double bytesPerSecond = 0.0;
+        };
+
+        /**
+         * @brief Internal, removes a session from a room, must be called with mutex_ held
+         * @return true if it was a member
+         */
+        bool Remove(Room& room, Session* session);
+
+        /**
+         * @brief Internal, reclaims a room without members, must be called with mutex_ held
+         */
+        void Reclaim(Id id);
+
+        /**
+         * @brief Internal, finds a room by name, must be called with mutex_ held
+         * @return the room, or null if it doesn't exist
+         */
+        Room* Find(std::string_view name);
+
+        struct NameHash {
+            using is_transparent = void;
+            std::size_t operator()(std::string_view name) const noexcept { return std::hash<std::string_view>()(name); }
+        };
+
+        std::size_t maxRooms_;
+        std::size_t maxJoins_;
+
+        mutable std::mutex mutex_;
+        std::vector<Room> rooms_;                                                           /**< indexed by room identifier */
+        std::vector<Id> vacant_;                                                            /**< reclaimed slots of rooms_ */
+        std::unordered_map<std::string, Id, NameHash, std::equal_to<>> index_;              /**< room name to identifier */
+        std::unordered_map<Session*, std::vector<Id>> memberships_;                         /**< the rooms of every session */
+        std::chrono::steady_clock::time_point sampled_ = std::chrono::steady_clock::now();
+    };
+}
+
+#endif // CHATAPP_ROOMS_HPP
@@ -0,0 +1,748 @@
+/**
+ * @file Session.cpp
+ * @brief Implements the Chat::Session class
+ * @author Noak Palander
+ * @version 1.0
+ * @see Session.hpp
+ */
+
+#include "Session.hpp"
+
+#include "asio/post.hpp"
+#include "asio/read.hpp"
+#include "asio/write.hpp"
+#include "Capture.hpp"
+#include "Clock.hpp"
+#include "Trace.hpp"
+#include "Wire.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#ifdef __linux__
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/sendfile.h>
+    #include <sys/socket.h>
+#endif
+
+namespace Chat {
+    namespace {
+        /**
+         * @brief The length prefix, the type, the echo flag and the sender's timestamp
+         */
+        constexpr std::size_t HeartbeatSize = sizeof(std::uint32_t) + 2 + sizeof(std::int64_t);
+
+        std::int64_t Nanoseconds(std::chrono::steady_clock::time_point time) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+        }
+
+        /**
+         * @param stamp the sender's timestamp, only ever interpreted by the sender
+         * @param echo whether it answers a heartbeat from the peer
+         */
+        Packet HeartbeatPacket(std::int64_t stamp, bool echo) {
+            std::vector<std::byte> packet(HeartbeatSize);
+            std::byte* ptr = packet.data();
+
+            Wire::Store(ptr, static_cast<std::uint32_t>(HeartbeatSize - sizeof(std::uint32_t)));
+            ptr += sizeof(std::uint32_t);
+            Wire::Store(ptr++, MessageType::Heartbeat);
+            Wire::Store(ptr++, static_cast<std::uint8_t>(echo));
+            Wire::Store(ptr, stamp);
+            return std::make_shared<std::vector<std::byte> const>(std::move(packet));
+        }
+
+        /**
+         * @brief Whether a frame doesn't count as a message, answers to what we sent follow our rate rather than the peer's,
+         * an honest member of a busy room acknowledges every message it's forwarded
+         * @param frame the start of the frame, at least its fixed part when the size matches
+         * @param total the size of the frame, including the length prefix
+         *
+         * Only the type byte is the peer's claim, so only a frame with exactly the size of such an answer is exempt, and a
+         * heartbeat only when it echoes ours, a probe makes us send the echo.
+         */
+        bool Answer(std::byte const* frame, std::size_t total) noexcept {
+            switch (static_cast<MessageType>(frame[sizeof(std::uint32_t)])) {
+                // An acknowledgement is a bare header, followed by the newline of its empty contents
+                case MessageType::Acknowledge:
+                    return total == sizeof(Wire::Header) + 1;
+
+                case MessageType::ClockReply:
+                    return total == ClockReplySize;
+
+                case MessageType::Heartbeat:
+                    return total == HeartbeatSize && Wire::Load<std::uint8_t>(frame + sizeof(std::uint32_t) + 1) == 1;
+
+                default:
+                    return false;
+            }
+        }
+    }
+
+    Session::Session(Id id, asio::ip::tcp::socket socket, FlowControl const& flow, Liveness const& liveness, RateLimits const& limits,
+                     std::shared_ptr<SlabPool> pool, Callbacks callbacks, Capture* capture)
+        :   id_{id},
+            socket_{std::move(socket)},
+            overflowTimer_{socket_.get_executor()},
+            livenessTimer_{socket_.get_executor()},
+            throttleTimer_{socket_.get_executor()},
+            flow_{flow},
+            liveness_{liveness},
+            limits_{limits},
+            messageRate_{limits.messagesPerSecond, limits.messagesPerSecond * std::chrono::duration<double>(limits.burst).count()},
+            byteRate_{limits.bytesPerSecond, limits.bytesPerSecond * std::chrono::duration<double>(limits.burst).count()},
+            callbacks_{std::move(callbacks)},
+            capture_{capture},
+            pool_{std::move(pool)}
+    {
+        asio::error_code ec;
+        if (auto const endpoint = socket_.remote_endpoint(ec); !ec)
+            remote_ = endpoint.address();
+
+        // A low watermark above the high one would never release a congested session
+        flow_.lowWatermark = std::min(flow_.lowWatermark, flow_.highWatermark);
+        flow_.hardLimit = std::max(flow_.hardLimit, flow_.highWatermark);
+    }
+
+    Session::~Session() {
+        Recycle();
+    }
+
+    void Session::Start() {
+        // Required by sendfile, asio handles non-blocking sockets transparently
+        asio::error_code ec;
+        socket_.native_non_blocking(true, ec);
+
+        // Small control packets such as acknowledgements and clock probes mustn't wait for the previous write to be acknowledged
+        socket_.set_option(asio::ip::tcp::no_delay(true), ec);
+
+        if (liveness_.interval.count() > 0) {
+            lastReceived_ = lastTraffic_ = lastProbe_ = std::chrono::steady_clock::now();
+
+            if (liveness_.keepalive) {
+                socket_.set_option(asio::socket_base::keep_alive(true), ec);
+
+#ifdef __linux__
+                // The kernel probes in whole seconds, it's a backstop for when the heartbeats can't be sent at all
+                int const idle = static_cast<int>(std::max<std::int64_t>(1, (liveness_.interval.count() + 999) / 1000));
+                int const count = static_cast<int>(std::max<std::int64_t>(1, liveness_.timeout / liveness_.interval));
+
+                ::setsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+                ::setsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+                ::setsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+            }
+
+            Watch();
+        }
+
+#ifdef __linux__
+        // The kernel also counts a zero window as unacknowledged, so a slow reader is left to the overflow policy and only
+        // a connection that's stuck for much longer is given up on
+        if (liveness_.writeTimeout.count() > 0) {
+            auto const timeout = static_cast<unsigned>(liveness_.writeTimeout.count());
+            ::setsockopt(socket_.native_handle(), IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+        }
+#endif
+
+        Receive();
+    }
+
+    void Session::Receive() {
+        // Reads the length prefix first, the slabs are only taken from the pool once a frame arrives
+        asio::async_read(socket_, asio::buffer(prefix_), [self = shared_from_this()](asio::error_code ec, std::size_t) {
+            if (self->closed_)
+                return;
+
+            // The peer disconnected, or the connection broke
+            if (ec) [[unlikely]] {
+                self->Close();
+                return;
+            }
+
+            self->lastReceived_ = std::chrono::steady_clock::now();
+            auto const length = Wire::Load<std::uint32_t>(self->prefix_.data());
+
+            // A peer announcing an oversized packet is either broken or malicious
+            if (length == 0 || length > MaxPacket) [[unlikely]] {
+                Trace::Emit(Trace::Event::PacketRejected, self->id_, length);
+                self->Close();
+                return;
+            }
+
+            // The whole packet including the prefix is handed to the owner
+            self->slabs_.push_back(self->pool_->Acquire());
+            std::memcpy(self->slabs_.back().get(), self->prefix_.data(), self->prefix_.size());
+            self->Continue(self->prefix_.size() + length, self->prefix_.size());
+        });
+    }
+
+    void Session::Continue(std::size_t total, std::size_t received) {
+        if (received == total) {
+            Dispatch(total);
+            return;
+        }
+
+        // Large frames take one slab at a time, so a peer announcing a large packet only ties up what it actually sends
+        auto const slabSize = pool_->SlabSize();
+        auto const offset = received % slabSize;
+        if (offset == 0)
+            slabs_.push_back(pool_->Acquire());
+
+        auto const length = std::min(slabSize - offset, total - received);
+        asio::async_read(socket_, asio::buffer(slabs_.back().get() + offset, length),
+                         [self = shared_from_this(), total, received](asio::error_code ec, std::size_t bytes) {
+            if (self->closed_) {
+                self->Recycle();
+                return;
+            }
+
+            if (ec) [[unlikely]] {
+                self->Recycle();
+                self->Close();
+                return;
+            }
+
+            self->lastReceived_ = std::chrono::steady_clock::now();
+            self->Continue(total, received + bytes);
+        });
+    }
+
+    void Session::Dispatch(std::size_t total) {
+        auto const type = slabs_.front()[sizeof(std::uint32_t)];
+        if (type != static_cast<std::byte>(MessageType::Heartbeat))
+            lastTraffic_ = lastReceived_;
+
+        if (!Admit(total, !Answer(slabs_.front().get(), total))) {
+            Recycle();
+
+            if (limits_.action == Throttle::Drop)
+                Receive();
+            else
+                Close();
+            return;
+        }
+
+        std::span<std::byte const> packet(slabs_.front().get(), total);
+
+        // The decoders need contiguous bytes, a chained frame is gathered once and its slabs go back before it's handled
+        std::vector<std::byte> gathered;
+        if (slabs_.size() > 1) {
+            gathered.resize(total);
+
+            auto const slabSize = pool_->SlabSize();
+            for (std::size_t i = 0, offset = 0; offset < total; ++i, offset += slabSize)
+                std::memcpy(gathered.data() + offset, slabs_[i].get(), std::min(slabSize, total - offset));
+
+            Recycle();
+            packet = gathered;
+        }
+
+        if (capture_)
+            capture_->Record(Direction::Received, id_, packet);
+
+        callbacks_.onPacket(*this, packet);
+        Recycle();
+
+        if (!closed_)
+            Resume();
+    }
+
+    bool Session::Admit(std::size_t bytes, bool counted) {
+        auto const now = std::chrono::steady_clock::now();
+
+        // Both buckets are refilled, a frame is admitted while neither is overdrawn, answers are only held to the byte rate
+        bool const messages = messageRate_.Ready(now) || !counted;
+        bool const ready = byteRate_.Ready(now) && messages;
+
+        if (!ready && limits_.action != Throttle::Delay) {
+            throttled_.fetch_add(1, std::memory_order_relaxed);
+
+            if (limits_.action == Throttle::Drop)
+                Trace::Emit(Trace::Event::SessionThrottleDropped, id_, bytes);
+            else
+                Trace::Emit(Trace::Event::SessionThrottleClosed, id_);
+
+            if (callbacks_.onThrottle)
+                callbacks_.onThrottle(*this, limits_.action);
+            return false;
+        }
+
+        // Delayed frames are always admitted, the next read waits for the debt instead
+        if (counted)
+            messageRate_.Charge(1.0, now);
+
+        byteRate_.Charge(static_cast<double>(bytes), now);
+        return true;
+    }
+
+    void Session::Resume() {
+        auto const debt = std::max(messageRate_.Debt(), byteRate_.Debt());
+        if (limits_.action != Throttle::Delay || debt.count() == 0) {
+            Receive();
+            return;
+        }
+
+        // The peer's frames pile up in the socket buffers meanwhile, and TCP's flow control slows the peer down
+        throttled_.fetch_add(1, std::memory_order_relaxed);
+        Trace::Emit(Trace::Event::SessionThrottled, id_, std::chrono::duration_cast<std::chrono::microseconds>(debt).count());
+
+        if (callbacks_.onThrottle)
+            callbacks_.onThrottle(*this, Throttle::Delay);
+
+        paused_ = true;
+        throttleTimer_.expires_after(debt);
+        throttleTimer_.async_wait([self = shared_from_this()](asio::error_code ec) {
+            self->paused_ = false;
+            if (ec || self->closed_)
+                return;
+
+            // The silence while paused was our own doing
+            self->lastReceived_ = std::chrono::steady_clock::now();
+            self->Receive();
+        });
+    }
+
+    void Session::Unlimit() noexcept {
+        messageRate_ = TokenBucket();
+        byteRate_ = TokenBucket();
+        unlimited_ = true;
+    }
+
+    void Session::Recycle() noexcept {
+        for (auto& slab : slabs_)
+            pool_->Release(std::move(slab));
+
+        slabs_.clear();
+
+        // The chain of a huge frame isn't kept around either
+        if (slabs_.capacity() > 4)
+            slabs_.shrink_to_fit();
+    }
+
+    void Session::Watch() {
+        // Wakes up for the next heartbeat, or exactly at the deadline if it's sooner
+        auto const now = std::chrono::steady_clock::now();
+        livenessTimer_.expires_at(std::min(lastReceived_ + liveness_.timeout, now + liveness_.interval));
+        livenessTimer_.async_wait([self = shared_from_this()](asio::error_code ec) {
+            if (ec || self->closed_)
+                return;
+
+            auto const now = std::chrono::steady_clock::now();
+            auto const silent = now - self->lastReceived_;
+
+            // On a saturated io thread the timer can run before a pending read completes, unread bytes prove the peer is alive
+            asio::error_code ignored;
+            if (silent >= self->liveness_.timeout && !self->paused_ && self->socket_.available(ignored) == 0) {
+                Trace::Emit(Trace::Event::PeerTimedOut, self->id_, std::chrono::duration_cast<std::chrono::milliseconds>(silent).count());
+                self->Close();
+                return;
+            }
+
+            // A busy connection already proves that the peer is alive, only an idle one is probed
+            auto const& interval = self->liveness_.interval;
+            if (now - self->lastTraffic_ >= interval && now - self->lastProbe_ >= interval) {
+                self->lastProbe_ = now;
+                self->Send(HeartbeatPacket(Nanoseconds(now), false), Priority::Control);
+            }
+
+            self->Watch();
+        });
+    }
+
+    bool Session::Heartbeat(std::span<std::byte const> packet) {
+        if (packet.size() != HeartbeatSize)
+            return false;
+
+        std::byte const* ptr = packet.data() + sizeof(std::uint32_t) + 1;
+        auto const echo = Wire::Load<std::uint8_t>(ptr);
+        auto const stamp = Wire::Load<std::int64_t>(ptr + 1);
+
+        // The stamp is echoed back untouched, only the sender can interpret it
+        if (echo == 0) {
+            Send(HeartbeatPacket(stamp, true), Priority::Control);
+            return true;
+        }
+
+        auto const sample = Nanoseconds(std::chrono::steady_clock::now()) - stamp;
+        if (echo != 1 || sample < 0)
+            return false;
+
+        // Smoothed with the same gain as TCP's round trip estimate
+        auto const previous = roundTrip_.load(std::memory_order_relaxed);
+        roundTrip_.store(previous == 0 ? sample : previous + (sample - previous) / 8, std::memory_order_relaxed);
+        return true;
+    }
+
+    void Session::Send(Packet packet, Priority priority) {
+        // Detached sessions only exist to replay captures
+        if (closed_ || !packet || !socket_.is_open())
+            return;
+
+        auto const size = static_cast<std::ptrdiff_t>(packet->size());
+        Queue(priority).push_back(std::move(packet));
+        queuedPackets_.fetch_add(1, std::memory_order_relaxed);
+        Account(size);
+
+        if (congested_.load(std::memory_order_relaxed))
+            Overflowed();
+
+        Write();
+    }
+
+    void Session::Attach(std::shared_ptr<OutgoingTransfer> transfer) {
+        if (closed_ || !transfer || !socket_.is_open())
+            return;
+
+        transfers_.push_back(Cursor{ .transfer = std::move(transfer) });
+        transfersActive_.fetch_add(1, std::memory_order_relaxed);
+        Write();
+    }
+
+    void Session::Write() {
+        if (writing_ || closed_)
+            return;
+
+        // The most important non-empty queue is written first
+        for (auto const priority : { Priority::Control, Priority::Chat, Priority::Bulk }) {
+            auto& queue = Queue(priority);
+            if (queue.empty())
+                continue;
+
+            writing_ = true;
+            writingQueue_ = priority;
+
+            if (capture_)
+                capture_->Record(Direction::Sent, id_, *queue.front());
+
+            // The packet is owned by the queue until the handler pops it
+            asio::async_write(socket_, asio::buffer(*queue.front()), [self = shared_from_this()](asio::error_code ec, std::size_t bytes) {
+                self->writing_ = false;
+                if (self->closed_)
+                    return;
+
+                if (ec) [[unlikely]] {
+                    Trace::Emit(Trace::Event::TransmitFailed, ec.value());
+                    self->Close();
+                    return;
+                }
+
+                Trace::Emit(Trace::Event::Transmitted, bytes);
+
+                auto& written = self->Queue(*self->writingQueue_);
+                auto const size = static_cast<std::ptrdiff_t>(written.front()->size());
+                written.pop_front();
+                self->queuedPackets_.fetch_sub(1, std::memory_order_relaxed);
+                self->Account(-size);
+
+                self->Write();
+            });
+            return;
+        }
+
+        // Transfers only use the connection when there's nothing else to write
+        if (!transfers_.empty())
+            WriteChunk();
+    }
+
+    void Session::WriteChunk() {
+        Cursor& cursor = transfers_.front();
+        auto const& transfer = cursor.transfer;
+
+        writing_ = true;
+        writingQueue_.reset();
+
+        // The offer precedes the first chunk, our own chunks aren't captured as they're sent straight from the source
+        if (!cursor.offered) {
+            auto offer = transfer->Offer();
+            if (capture_)
+                capture_->Record(Direction::Sent, id_, *offer);
+
+            asio::async_write(socket_, asio::buffer(*offer), [self = shared_from_this(), offer](asio::error_code ec, std::size_t) {
+                self->writing_ = false;
+                if (self->closed_)
+                    return;
+
+                if (ec) [[unlikely]] {
+                    self->Close();
+                    return;
+                }
+
+                self->transfers_.front().offered = true;
+                self->Chunked(0);
+            });
+            return;
+        }
+
+        auto const length = static_cast<std::size_t>(std::min<std::uint64_t>(OutgoingTransfer::ChunkSize, transfer->Size() - cursor.offset));
+        chunkHeader_ = transfer->ChunkHeader(cursor.offset, length);
+
+    #ifdef __linux__
+        // Files skip user space entirely, only the header is written through asio
+        if (transfer->Descriptor() >= 0) {
+            asio::async_write(socket_, asio::buffer(chunkHeader_), [self = shared_from_this(), transfer, offset = cursor.offset, length](asio::error_code ec, std::size_t) {
+                if (self->closed_) {
+                    self->writing_ = false;
+                    return;
+                }
+
+                if (ec) [[unlikely]] {
+                    self->writing_ = false;
+                    self->Close();
+                    return;
+                }
+
+                self->SendFile(transfer, offset, length, length);
+            });
+            return;
+        }
+    #endif
+
+        std::span<std::byte const> payload;
+        try {
+            payload = transfer->Payload(cursor.offset, length, scratch_);
+        }
+        catch (std::system_error const& e) {
+            Trace::Emit(Trace::Event::TransferFailed, transfer->Identifier(), e.code().value());
+            payload = {};
+        }
+
+        // Nothing has been written for this chunk yet, so a short read only fails the transfer
+        if (payload.size() != length) {
+            writing_ = false;
+            Abandon();
+            Write();
+            return;
+        }
+
+        std::array<asio::const_buffer, 2> const buffers{ asio::buffer(chunkHeader_), asio::buffer(payload.data(), payload.size()) };
+        asio::async_write(socket_, buffers, [self = shared_from_this(), transfer, length](asio::error_code ec, std::size_t) {
+            self->writing_ = false;
+            if (self->closed_)
+                return;
+
+            if (ec) [[unlikely]] {
+                self->Close();
+                return;
+            }
+
+            self->Chunked(length);
+        });
+    }
+
+    void Session::SendFile(std::shared_ptr<OutgoingTransfer> transfer, std::uint64_t offset, std::size_t remaining, std::size_t length) {
+    #ifdef __linux__
+        auto position = static_cast<off_t>(offset);
+
+        while (remaining > 0) {
+            auto const sent = ::sendfile(socket_.native_handle(), transfer->Descriptor(), &position, remaining);
+            if (sent > 0) {
+                remaining -= static_cast<std::size_t>(sent);
+                continue;
+            }
+
+            if (sent < 0 && errno == EINTR)
+                continue;
+
+            // The socket buffer is full, continue once it's writable
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                socket_.async_wait(asio::socket_base::wait_write, [self = shared_from_this(), transfer, position, remaining, length](asio::error_code ec) {
+                    if (self->closed_) {
+                        self->writing_ = false;
+                        return;
+                    }
+
+                    if (ec) [[unlikely]] {
+                        self->writing_ = false;
+                        self->Close();
+                        return;
+                    }
+
+                    self->SendFile(transfer, static_cast<std::uint64_t>(position), remaining, length);
+                });
+                return;
+            }
+
+            // Either an error, or the file was truncated, the header already announced the length so the stream is unusable
+            Trace::Emit(Trace::Event::TransferFailed, transfer->Identifier(), sent < 0 ? errno : EIO);
+            writing_ = false;
+            Abandon();
+            Close();
+            return;
+        }
+
+        Trace::Emit(Trace::Event::Transmitted, length);
+    #endif
+        writing_ = false;
+        Chunked(length);
+    }
+
+    void Session::Chunked(std::size_t length) {
+        Cursor cursor = std::move(transfers_.front());
+        transfers_.pop_front();
+
+        cursor.offset += length;
+        bool const complete = cursor.offset >= cursor.transfer->Size();
+
+        if ((length > 0 || complete) && callbacks_.onSent)
+            callbacks_.onSent(*this, *cursor.transfer, cursor.offset, false);
+
+        // Unfinished transfers take turns, one chunk each
+        if (complete)
+            transfersActive_.fetch_sub(1, std::memory_order_relaxed);
+        else
+            transfers_.push_back(std::move(cursor));
+
+        Write();
+    }
+
+    void Session::Abandon() {
+        if (transfers_.empty())
+            return;
+
+        auto const cursor = std::move(transfers_.front());
+        transfers_.pop_front();
+        transfersActive_.fetch_sub(1, std::memory_order_relaxed);
+
+        if (callbacks_.onSent)
+            callbacks_.onSent(*this, *cursor.transfer, cursor.offset, true);
+    }
+
+    void Session::Overflowed() {
+        if (unlimited_)
+            return;
+
+        switch (flow_.policy) {
+            // Producers outside of the io thread block in Processor::Transmit, the io thread's own fan-out is capped here instead
+            case Overflow::Block:
+                if (QueuedBytes() < flow_.hardLimit)
+                    break;
+
+                DropOldest();
+
+                // Only control packets and relayed chunks are left, neither can be dropped, the session is closed once the
+                // producer is done since it may be iterating over the sessions
+                if (QueuedBytes() >= flow_.hardLimit) {
+                    asio::post(socket_.get_executor(), [self = shared_from_this()] {
+                        if (self->closed_)
+                            return;
+
+                        Trace::Emit(Trace::Event::SessionOverflowed, self->id_, self->QueuedBytes());
+                        self->Close();
+                    });
+                }
+                break;
+
+            case Overflow::DropOldest:
+                DropOldest();
+                break;
+
+            case Overflow::Disconnect:
+                // Armed once per congestion period, cancelled when the session drains
+                if (overflowTimer_.expiry() > std::chrono::steady_clock::now())
+                    break;
+
+                overflowTimer_.expires_after(flow_.disconnectAfter);
+                overflowTimer_.async_wait([self = shared_from_this()](asio::error_code ec) {
+                    if (ec || self->closed_ || !self->Congested())
+                        return;
+
+                    Trace::Emit(Trace::Event::SessionOverflowed, self->id_, self->QueuedBytes());
+                    self->Close();
+                });
+                break;
+        }
+    }
+
+    void Session::DropOldest() {
+        // Only chat messages are dropped, the front is being written and can't be dropped
+        auto& queue = Queue(Priority::Chat);
+        auto iter = queue.begin() + (writing_ && writingQueue_ == Priority::Chat ? 1 : 0);
+        std::uint64_t dropped = 0;
+
+        while (iter != queue.end() && QueuedBytes() >= flow_.highWatermark) {
+            auto const size = static_cast<std::ptrdiff_t>((*iter)->size());
+            iter = queue.erase(iter);
+            queuedPackets_.fetch_sub(1, std::memory_order_relaxed);
+            ++dropped;
+
+            // Accounting may report that the session drained, which invalidates nothing in the queue
+            Account(-size);
+        }
+
+        if (dropped > 0) {
+            dropped_.fetch_add(dropped, std::memory_order_relaxed);
+            Trace::Emit(Trace::Event::SessionDropped, id_, dropped);
+        }
+    }
+
+    void Session::Account(std::ptrdiff_t added) {
+        // Only the io thread modifies the counters, the atomics are for observers on other threads
+        auto const bytes = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(queuedBytes_.load(std::memory_order_relaxed)) + added);
+        queuedBytes_.store(bytes, std::memory_order_relaxed);
+
+        if (bytes > peakBytes_.load(std::memory_order_relaxed))
+            peakBytes_.store(bytes, std::memory_order_relaxed);
+
+        if (!congested_.load(std::memory_order_relaxed) && bytes >= flow_.highWatermark) {
+            congested_.store(true, std::memory_order_relaxed);
+            Trace::Emit(Trace::Event::SessionCongested, id_, bytes);
+
+            if (callbacks_.onPressure)
+                callbacks_.onPressure(*this, true);
+        }
+        else if (congested_.load(std::memory_order_relaxed) && bytes <= flow_.lowWatermark) {
+            congested_.store(false, std::memory_order_relaxed);
+
+            // Resetting the expiry cancels the timer and lets the next congestion period arm it again
+            overflowTimer_.expires_at(asio::steady_timer::time_point::min());
+            Trace::Emit(Trace::Event::SessionDrained, id_, bytes);
+
+            if (callbacks_.onPressure)
+                callbacks_.onPressure(*this, false);
+        }
+    }
+
+    void Session::Close() {
+        if (closed_)
+            return;
+
+        closed_ = true;
+        overflowTimer_.cancel();
+        livenessTimer_.cancel();
+        throttleTimer_.cancel();
+
+        if (socket_.is_open()) {
+            asio::error_code ec;
+            socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+            socket_.close(ec);
+        }
+
+        // Unfinished transfers are reported as failed
+        while (!transfers_.empty())
+            Abandon();
+
+        // A congested session that goes away must release blocked producers
+        if (congested_.exchange(false, std::memory_order_relaxed) && callbacks_.onPressure)
+            callbacks_.onPressure(*this, false);
+
+        if (callbacks_.onClose)
+            callbacks_.onClose(*this);
+    }
+
+    SessionStats Session::Stats() const noexcept {
+        return SessionStats{
+            .id = id_,
+            .queuedBytes = queuedBytes_.load(std::memory_order_relaxed),
+            .queuedPackets = queuedPackets_.load(std::memory_order_relaxed),
+            .peakBytes = peakBytes_.load(std::memory_order_relaxed),
+            .dropped = dropped_.load(std::memory_order_relaxed),
+            .transfers = transfersActive_.load(std::memory_order_relaxed),
+            .roundTrip = std::chrono::nanoseconds(roundTrip_.load(std::memory_order_relaxed)),
+            .throttled = throttled_.load(std::memory_order_relaxed),
+            .congested = congested_.load(std::memory_order_relaxed)
+        };
+    }
+}
@@ -0,0 +1,340 @@
+/**
+ * @file Session.hpp
+ * @brief Contains the declaration of the Chat::Session class, a single connection with a bounded outbound queue
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_SESSION_HPP
+#define CHATAPP_SESSION_HPP
+
+#include "asio/io_service.hpp"
+#include "asio/ip/tcp.hpp"
+#include "asio/steady_timer.hpp"
+#include "Limits.hpp"
+#include "Message.hpp"
+#include "Pool.hpp"
+#include "Transfer.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Chat {
+    class Capture;
+
+    /**
+     * @enum Chat::Priority
+     * @brief The outbound queue a packet is placed in, a session always writes from the most important non-empty queue
+     * @author Noak Palander
+     *
+     * Transfers are served after every queue, one chunk at a time, so a chat message waits for at most one chunk.
+     */
+    enum class Priority : unsigned char {
+        Control = 0,    /**< Small protocol packets such as acknowledgements, never dropped */
+        Chat = 1,       /**< Regular messages */
+        Bulk = 2        /**< Relayed transfer chunks and the batches sent over links between servers, never dropped */
+    };
+
+    /**
+     * @enum Chat::Overflow
+     * @brief What a session does once its outbound queue is above the high watermark
+     * @author Noak Palander
+     */
+    enum class Overflow {
+        Block = 0,          /**< Producers outside of the io thread are blocked until the queue drains below the low watermark, the io thread
+                                 can't block on its own fan-out so above FlowControl::hardLimit it falls back to DropOldest, then Disconnect */
+        DropOldest = 1,     /**< The oldest queued, not yet written, messages are dropped until the queue is below the high watermark */
+        Disconnect = 2      /**< The peer is disconnected if it stays above the high watermark for too long */
+    };
+
+    /**
+     * @struct Chat::FlowControl
+     * @brief The outbound backpressure configuration of a session
+     * @author Noak Palander
+     */
+    struct FlowControl {
+        std::size_t highWatermark = 4 * 1024 * 1024;        /**< Queued bytes at which the session is considered congested */
+        std::size_t lowWatermark = 1024 * 1024;             /**< Queued bytes at which a congested session is considered drained */
+        std::size_t hardLimit = 16 * 1024 * 1024;           /**< Queued bytes that Overflow::Block never lets the queue grow beyond */
+        Overflow policy = Overflow::Block;                  /**< What to do while congested */
+        std::chrono::milliseconds disconnectAfter{5000};    /**< Used by Overflow::Disconnect */
+    };
+
+    /**
+     * @struct Chat::Liveness
+     * @brief How a session detects a peer that vanished without closing the connection, such as a pulled cable or a frozen process
+     * @author Noak Palander
+     *
+     * A dead peer is detected within the timeout. Both ends send a heartbeat every interval while no other traffic arrives,
+     * and every echoed heartbeat is a round trip sample.
+     */
+    struct Liveness {
+        std::chrono::milliseconds interval{500};    /**< How often an idle session sends a heartbeat, 0 disables heartbeats and the timeout */
+        std::chrono::milliseconds timeout{1500};    /**< The peer is disconnected once nothing was received from it for this long */
+        bool keepalive = true;                      /**< Also configures TCP keepalive as a backstop for when heartbeats can't be sent */
+        std::chrono::milliseconds writeTimeout{0};  /**< Aborts a connection whose written data stays unacknowledged this long where supported,
+                                                         it also catches a live peer that stops reading, so it should be far above the timeout, 0 disables it */
+    };
+
+    /**
+     * @struct Chat::SessionStats
+     * @brief A snapshot of a session's outbound queue
+     * @author Noak Palander
+     */
+    struct SessionStats {
+        std::uint32_t id;
+        std::size_t queuedBytes;
+        std::size_t queuedPackets;
+        std::size_t peakBytes;      /**< The largest queue depth seen, in bytes */
+        std::uint64_t dropped;      /**< Messages dropped by Overflow::DropOldest, or by Overflow::Block above the hard limit */
+        std::size_t transfers;      /**< Outgoing transfers that haven't completed */
+        std::chrono::nanoseconds roundTrip;    /**< The smoothed heartbeat round trip, 0 until the first echo */
+        std::uint64_t throttled;    /**< Times the rate limits were enforced */
+        bool congested;
+    };
+
+    /**
+     * @class Chat::Session
+     * @brief A single TCP connection, reads length-prefixed packets and writes queued packets and transfer chunks one at a time
+     * @author Noak Palander
+     *
+     * Every member function except the statistics getters must be called on the thread running the io_service.
+     */
+    class Session : public std::enable_shared_from_this<Session> {
+    public:
+        using Id = std::uint32_t;
+
+        /**
+         * @brief The largest packet accepted from a peer, larger announcements close the session
+         */
+        static constexpr std::uint32_t MaxPacket = 64 * 1024 * 1024;
+
+        /**
+         * @struct Chat::Session::Callbacks
+         * @brief The events a session reports back to its owner
+         */
+        struct Callbacks {
+            std::function<void(Session&, std::span<std::byte const>)> onPacket;     /**< A complete packet was received */
+            std::function<void(Session&, bool)> onPressure;                         /**< The high (true) or low (false) watermark was crossed */
+            std::function<void(Session&)> onClose;                                  /**< The session was closed, invoked once */
+            std::function<void(Session&, OutgoingTransfer const&, std::uint64_t, bool)> onSent;  /**< Bytes of a transfer were sent, or it failed */
+            std::function<void(Session&, Throttle)> onThrottle;                     /**< The rate limits were enforced with the given action */
+        };
+
+        /**
+         * @brief Constructs a session around an already connected socket, nothing happens until Start is invoked
+         * @param id a unique identifier for the session
+         * @param socket the connected socket
+         * @param flow the outbound backpressure configuration
+         * @param liveness how a vanished peer is detected
+         * @param limits the inbound rate limits
+         * @param pool the receive buffers, shared by every session of the owner
+         * @param callbacks the events reported back to the owner
+         * @param capture records every packet written and received when set, must outlive the session
+         *
+         * A session around a socket that was never opened is detached, it discards everything it's sent, it's used to replay captures.
+         */
+        Session(Id id, asio::ip::tcp::socket socket, FlowControl const& flow, Liveness const& liveness, RateLimits const& limits,
+                std::shared_ptr<SlabPool> pool, Callbacks callbacks, Capture* capture = nullptr);
+
+        ~Session();
+
+        /**
+         * @brief Starts reading from the socket
+         */
+        void Start();
+
+        /**
+         * @brief Queues a packet for writing
+         * @param packet the packet to send
+         * @param priority the queue to place it in
+         */
+        void Send(Packet packet, Priority priority = Priority::Chat);
+
+        /**
+         * @brief Queues a transfer, its chunks are read from the source as the connection drains and don't count towards the
+         * watermarks, files are sent with sendfile where it's available
+         * @param transfer the transfer to send
+         */
+        void Attach(std::shared_ptr<OutgoingTransfer> transfer);
+
+        /**
+         * @brief Handles a received heartbeat, a probe is echoed back and an echo of our own probe is a round trip sample
+         * @param packet the received heartbeat
+         * @return false if it's malformed
+         */
+        bool Heartbeat(std::span<std::byte const> packet);
+
+        /**
+         * @brief Lifts the rate limits and the overflow policy, a link between servers carries the traffic of many clients and
+         * its batches can't be dropped without losing them across the mesh, a dead link is still detected by the heartbeats
+         */
+        void Unlimit() noexcept;
+
+        /**
+         * @brief Closes the socket and reports it through onClose, does nothing if it's already closed
+         */
+        void Close();
+
+        [[nodiscard]] Id Identifier() const noexcept { return id_; }
+
+        /**
+         * @return the address of the peer, or nothing for a detached session
+         */
+        [[nodiscard]] std::optional<asio::ip::address> Remote() const noexcept { return remote_; }
+        [[nodiscard]] bool Open() const noexcept { return !closed_; }
+        [[nodiscard]] bool Congested() const noexcept { return congested_.load(std::memory_order_relaxed); }
+        [[nodiscard]] std::size_t QueuedBytes() const noexcept { return queuedBytes_.load(std::memory_order_relaxed); }
+
+        /**
+         * @brief Can be called from any thread
+         * @return a snapshot of the outbound queue
+         */
+        [[nodiscard]] SessionStats Stats() const noexcept;
+
+    private:
+        /**
+         * @brief Internal, starts an asynchronous read for the next packet
+         */
+        void Receive();
+
+        /**
+         * @brief Internal, reads the next part of the frame into the last slab of the chain, or a new one once it's full
+         * @param total the size of the frame, including the length prefix
+         * @param received the bytes of the frame already in the chain
+         */
+        void Continue(std::size_t total, std::size_t received);
+
+        /**
+         * @brief Internal, hands a completely received frame to the owner, and returns its slabs to the pool
+         * @param total the size of the frame, including the length prefix
+         */
+        void Dispatch(std::size_t total);
+
+        /**
+         * @brief Internal, charges a received frame to the rate limits
+         * @param bytes the size of the frame
+         * @param counted whether it counts as a message, the bytes of every frame are charged
+         * @return false if the peer is above its limits and the frame should be dropped, or the session closed
+         */
+        bool Admit(std::size_t bytes, bool counted);
+
+        /**
+         * @brief Internal, reads the next frame, once the peer is back within its limits under Throttle::Delay
+         */
+        void Resume();
+
+        /**
+         * @brief Internal, returns every slab of the chain to the pool
+         */
+        void Recycle() noexcept;
+
+        /**
+         * @brief Internal, arms the liveness timer for the next heartbeat, or the timeout if it's sooner
+         */
+        void Watch();
+
+        /**
+         * @brief Internal, writes the front of the most important queue, or the next transfer chunk, if nothing is being written
+         */
+        void Write();
+
+        /**
+         * @brief Internal, writes the offer or the next chunk of the front transfer
+         */
+        void WriteChunk();
+
+        /**
+         * @brief Internal, sends a chunk's payload straight from the file to the socket
+         * @param transfer the transfer being sent
+         * @param offset the file offset to continue from
+         * @param remaining bytes of the payload left to send
+         * @param length the payload length of the whole chunk
+         */
+        void SendFile(std::shared_ptr<OutgoingTransfer> transfer, std::uint64_t offset, std::size_t remaining, std::size_t length);
+
+        /**
+         * @brief Internal, advances the front transfer once a chunk was written, and rotates it behind the other transfers
+         * @param length the payload length of the written chunk
+         */
+        void Chunked(std::size_t length);
+
+        /**
+         * @brief Internal, gives up on the front transfer
+         */
+        void Abandon();
+
+        /**
+         * @brief Internal, applies the overflow policy after the queue grew
+         */
+        void Overflowed();
+
+        /**
+         * @brief Internal, drops the oldest queued chat messages, that aren't being written, until the queue is below the high watermark
+         */
+        void DropOldest();
+
+        /**
+         * @brief Internal, updates the queue depth and reports watermark crossings
+         * @param added bytes added to the queue, negative when bytes left it
+         */
+        void Account(std::ptrdiff_t added);
+
+        struct Cursor {
+            std::shared_ptr<OutgoingTransfer> transfer;
+            std::uint64_t offset = 0;
+            bool offered = false;
+        };
+
+        [[nodiscard]] std::deque<Packet>& Queue(Priority priority) noexcept { return queues_[static_cast<std::size_t>(priority)]; }
+
+        Id id_;
+        asio::ip::tcp::socket socket_;
+        std::optional<asio::ip::address> remote_;  /**< Kept from the start, the socket no longer knows it once it's closed */
+        asio::steady_timer overflowTimer_;          /**< Started when congested under Overflow::Disconnect */
+        asio::steady_timer livenessTimer_;          /**< Sends heartbeats and enforces the timeout, see Watch */
+        asio::steady_timer throttleTimer_;          /**< Resumes reading under Throttle::Delay */
+        FlowControl flow_;
+        Liveness liveness_;
+        RateLimits limits_;
+        TokenBucket messageRate_;
+        TokenBucket byteRate_;
+        Callbacks callbacks_;
+        Capture* capture_;                          /**< Records every packet when set, not owned */
+
+        std::shared_ptr<SlabPool> pool_;
+        std::array<std::byte, sizeof(std::uint32_t)> prefix_{};    /**< The length prefix of the next frame, all an idle session holds */
+        std::vector<SlabPool::Slab> slabs_;         /**< The frame being received, every slab but the last is full */
+        std::array<std::deque<Packet>, 3> queues_;  /**< One queue per Priority */
+        std::deque<Cursor> transfers_;              /**< The front is being written while writing_ is set without a writingQueue_ */
+        std::vector<std::byte> chunkHeader_;        /**< The header of the chunk being written */
+        std::vector<std::byte> scratch_;            /**< The payload of the chunk being written, when it's read from a file */
+        std::optional<Priority> writingQueue_;      /**< The queue whose front is being written */
+        bool writing_ = false;
+        bool closed_ = false;
+        bool unlimited_ = false;                    /**< Set by Unlimit, the overflow policy doesn't apply */
+        bool paused_ = false;                       /**< Reading is paused by the rate limits, the peer isn't timed out meanwhile */
+
+        std::chrono::steady_clock::time_point lastReceived_;    /**< Any bytes, including heartbeats */
+        std::chrono::steady_clock::time_point lastTraffic_;     /**< Any packet but a heartbeat, heartbeats are only sent while it's idle */
+        std::chrono::steady_clock::time_point lastProbe_;       /**< When our last heartbeat was sent */
+
+        std::atomic<std::size_t> queuedBytes_{0};
+        std::atomic<std::size_t> queuedPackets_{0};
+        std::atomic<std::size_t> peakBytes_{0};
+        std::atomic<std::uint64_t> dropped_{0};
+        std::atomic<std::size_t> transfersActive_{0};
+        std::atomic<std::int64_t> roundTrip_{0};   /**< Nanoseconds */
+        std::atomic<std::uint64_t> throttled_{0};
+        std::atomic<bool> congested_{false};
+    };
+}
+
+#endif // CHATAPP_SESSION_HPP
@@ -0,0 +1,313 @@
+/**
+ * @file Trace.cpp
+ * @brief Implements the per-thread trace rings and the background collector
+ * @author Noak Palander
+ * @version 1.0
+ * @see Trace.hpp
+ */
+
+#include "Trace.hpp"
+
+#include "fmt/format.h"
+#include "fmt/args.h"
+#include "fmt/chrono.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Trace {
+    namespace {
+        /**
+         * @class Ring
+         * @brief A single-producer single-consumer ring of records, the owning thread produces and the collector consumes
+         */
+        struct Ring {
+            static constexpr std::size_t Capacity = 4096;
+            static_assert(std::has_single_bit(Capacity));
+
+            explicit Ring(std::uint32_t id) : thread{id} {}
+
+            std::array<Detail::Record, Capacity> records{};
+            alignas(64) std::atomic<std::uint64_t> head{0};     /**< written by the producer */
+            alignas(64) std::atomic<std::uint64_t> tail{0};     /**< written by the collector */
+            std::uint64_t cachedTail = 0;                       /**< producer-local copy of tail, avoids touching its cache line */
+            std::atomic<std::uint64_t> dropped{0};
+            std::atomic<bool> orphaned{false};                  /**< set when the owning thread exits */
+            std::uint32_t thread;
+        };
+
+        /**
+         * @class Collector
+         * @brief Owns every ring, and periodically drains them in timestamp order on a background thread
+         */
+        class Collector {
+        public:
+            static Collector& Instance() {
+                static Collector collector;
+                return collector;
+            }
+
+            std::shared_ptr<Ring> Register() {
+                std::lock_guard lock(mutex_);
+                auto ring = std::make_shared<Ring>(nextThread_++);
+                rings_.push_back(ring);
+                return ring;
+            }
+
+            bool Open(std::string const& path) {
+                std::FILE* file = std::fopen(path.c_str(), "a");
+                if (!file)
+                    return false;
+
+                std::lock_guard lock(mutex_);
+                if (sink_ != stderr)
+                    std::fclose(sink_);
+
+                sink_ = file;
+                return true;
+            }
+
+            void Flush() {
+                std::lock_guard lock(mutex_);
+                Drain();
+            }
+
+            std::uint64_t Dropped() {
+                std::lock_guard lock(mutex_);
+                std::uint64_t total = retiredDrops_;
+                for (auto const& ring : rings_)
+                    total += ring->dropped.load(std::memory_order_relaxed);
+
+                return total;
+            }
+
+            ~Collector() {
+                worker_.request_stop();
+                worker_.join();
+
+                std::lock_guard lock(mutex_);
+                Drain();
+                if (sink_ != stderr)
+                    std::fclose(sink_);
+            }
+
+        private:
+            Collector()
+                :   originTicks_{Detail::Now()},
+                    originSteady_{std::chrono::steady_clock::now()},
+                    originSystem_{std::chrono::system_clock::now()}
+            {
+                if (char const* path = std::getenv("CHATAPP_TRACE_FILE"))
+                    Open(path);
+
+                worker_ = std::jthread([this](std::stop_token token) {
+                    std::mutex sleepMutex;
+                    std::condition_variable_any sleeper;
+
+                    while (!token.stop_requested()) {
+                        {
+                            std::unique_lock sleepLock(sleepMutex);
+                            sleeper.wait_for(sleepLock, token, std::chrono::milliseconds(20), []{ return false; });
+                        }
+
+                        std::lock_guard lock(mutex_);
+                        Drain();
+                    }
+                });
+            }
+
+            /**
+             * @brief Converts ticks into wall-clock time, calibrated over the whole lifetime of the collector
+             */
+            std::chrono::system_clock::time_point ToTime(std::uint64_t ticks) const {
+            #if defined(__x86_64__) || defined(__i386__)
+                double const nanos = static_cast<double>(static_cast<std::int64_t>(ticks - originTicks_)) * nanosPerTick_;
+            #else
+                double const nanos = static_cast<double>(static_cast<std::int64_t>(ticks - originTicks_));
+            #endif
+                return originSystem_ + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::duration<double, std::nano>(nanos));
+            }
+
+            void Calibrate() {
+                auto const ticks = Detail::Now();
+                auto const elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - originSteady_).count();
+                if (ticks > originTicks_ && elapsed > 0.0)
+                    nanosPerTick_ = elapsed / static_cast<double>(ticks - originTicks_);
+            }
+
+            /**
+             * @brief Formats every pending record, must be called with mutex_ held
+             */
+            void Drain() {
+                Calibrate();
+                pending_.clear();
+
+                for (auto const& ring : rings_) {
+                    auto const tail = ring->tail.load(std::memory_order_relaxed);
+                    auto const head = ring->head.load(std::memory_order_acquire);
+
+                    for (auto i = tail; i != head; ++i)
+                        pending_.push_back({ ring->records[i & (Ring::Capacity - 1)], ring->thread });
+
+                    ring->tail.store(head, std::memory_order_release);
+                }
+
+                // Records from different threads are merged by timestamp
+                std::stable_sort(pending_.begin(), pending_.end(), [](auto const& lhs, auto const& rhs) {
+                    return lhs.record.ticks < rhs.record.ticks;
+                });
+
+                fmt::memory_buffer out;
+                for (auto const& [record, thread] : pending_)
+                    Format(out, record, thread);
+
+                if (out.size() > 0) {
+                    std::fwrite(out.data(), 1, out.size(), sink_);
+                    std::fflush(sink_);
+                }
+
+                // Rings of exited threads are released once they're empty
+                std::erase_if(rings_, [this](auto const& ring) {
+                    bool const done = ring->orphaned.load(std::memory_order_acquire) &&
+                        ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire);
+
+                    if (done)
+                        retiredDrops_ += ring->dropped.load(std::memory_order_relaxed);
+
+                    return done;
+                });
+            }
+
+            void Format(fmt::memory_buffer& out, Detail::Record const& record, std::uint32_t thread) const {
+                auto const index = static_cast<std::size_t>(record.event);
+                if (index >= Detail::events.size())
+                    return;
+
+                auto const& info = Detail::events[index];
+
+                fmt::dynamic_format_arg_store<fmt::format_context> store;
+                for (std::uint8_t i = 0; i < record.argc; ++i) {
+                    switch (static_cast<Detail::ArgKind>((record.kinds >> (i * 2)) & 0b11)) {
+                        case Detail::ArgKind::Signed:
+                            store.push_back(static_cast<std::int64_t>(record.args[i]));
+                            break;
+                        case Detail::ArgKind::Floating:
+                            store.push_back(std::bit_cast<double>(record.args[i]));
+                            break;
+                        default:
+                            store.push_back(record.args[i]);
+                            break;
+                    }
+                }
+
+                auto const time = ToTime(record.ticks);
+                auto const seconds = std::chrono::time_point_cast<std::chrono::seconds>(time);
+                auto const micros = std::chrono::duration_cast<std::chrono::microseconds>(time - seconds).count();
+                fmt::format_to(std::back_inserter(out), "[{:%H:%M:%S}.{:06}] [T{}] [{}] ", seconds, micros, thread, Name(info.level));
+
+                try {
+                    fmt::vformat_to(std::back_inserter(out), info.format, store);
+                }
+                catch (fmt::format_error const&) {
+                    fmt::format_to(std::back_inserter(out), "<malformed event {}>", index);
+                }
+
+                out.push_back('\n');
+            }
+
+            static std::string_view Name(Level level) noexcept {
+                switch (level) {
+                    case Level::Error: return "error";
+                    case Level::Info:  return "info";
+                    case Level::Debug: return "debug";
+                    default:           return "off";
+                }
+            }
+
+            struct Pending {
+                Detail::Record record;
+                std::uint32_t thread;
+            };
+
+            std::mutex mutex_;
+            std::vector<std::shared_ptr<Ring>> rings_;
+            std::vector<Pending> pending_;
+            std::uint32_t nextThread_ = 0;
+            std::uint64_t retiredDrops_ = 0;
+            std::FILE* sink_ = stderr;
+
+            std::uint64_t originTicks_;
+            std::chrono::steady_clock::time_point originSteady_;
+            std::chrono::system_clock::time_point originSystem_;
+            double nanosPerTick_ = 1.0;
+
+            std::jthread worker_;   /**< declared last, so it's started after and stopped before everything else */
+        };
+
+        /**
+         * @class LocalRing
+         * @brief Thread-local handle, registers lazily and marks the ring as orphaned when the thread exits
+         */
+        struct LocalRing {
+            std::shared_ptr<Ring> ring = Collector::Instance().Register();
+
+            ~LocalRing() {
+                ring->orphaned.store(true, std::memory_order_release);
+            }
+        };
+
+        /**
+         * @brief Applies CHATAPP_TRACE during static initialization, before the first event can be emitted
+         */
+        [[maybe_unused]] bool const environmentLevel = []{
+            if (char const* level = std::getenv("CHATAPP_TRACE"))
+                SetLevel(ParseLevel(level, GetLevel()));
+
+            return true;
+        }();
+    }
+
+    void Detail::Push(Record const& record) noexcept {
+        thread_local LocalRing local;
+        Ring& ring = *local.ring;
+
+        auto const head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.cachedTail >= Ring::Capacity) {
+            ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+
+            if (head - ring.cachedTail >= Ring::Capacity) [[unlikely]] {
+                ring.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        ring.records[head & (Ring::Capacity - 1)] = record;
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    Level ParseLevel(std::string_view name, Level fallback) noexcept {
+        if (name == "off")   return Level::Off;
+        if (name == "error") return Level::Error;
+        if (name == "info")  return Level::Info;
+        if (name == "debug") return Level::Debug;
+        return fallback;
+    }
+
+    bool Open(std::string const& path) {
+        return Collector::Instance().Open(path);
+    }
+
+    void Flush() {
+        Collector::Instance().Flush();
+    }
+
+    std::uint64_t Dropped() noexcept {
+        return Collector::Instance().Dropped();
+    }
+}
@@ -0,0 +1,293 @@
+/**
+ * @file Trace.hpp
+ * @brief Contains the low-overhead binary trace facility that replaces the old debug printing
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * Emitting an event only stores a compact record (timestamp, event ID and raw arguments) into a lock-free ring owned by the
+ * calling thread, the formatting is deferred to a background collector thread. The verbosity can be switched at runtime, either
+ * through Trace::SetLevel or the CHATAPP_TRACE environment variable (off, error, info, debug), so it's safe to keep it on in Release.
+ */
+
+#ifndef CHATAPP_TRACE_HPP
+#define CHATAPP_TRACE_HPP
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+namespace Trace {
+    /**
+     * @enum Trace::Level
+     * @brief The verbosity of an event, events above the current level are discarded before anything is recorded
+     * @author Noak Palander
+     */
+    enum class Level : std::uint8_t {
+        Off = 0,    /**< Nothing is recorded */
+        Error = 1,  /**< Only failures are recorded */
+        Info = 2,   /**< Lifecycle events such as connects and disconnects */
+        Debug = 3   /**< Per message events, these are on the hot path */
+    };
+
+    /**
+     * @enum Trace::Event
+     * @brief Identifies a trace event, indexes into the event table which holds its level and deferred format string
+     * @author Noak Palander
+     */
+    enum class Event : std::uint16_t {
+        ServerStarted,
+        ClientStarted,
+        ServerStopped,
+        ClientStopped,
+        Connected,
+        Disconnected,
+        Transmitted,
+        TransmitFailed,
+        MessageSent,
+        MessageReceived,
+        AckReceived,
+        SessionCongested,
+        SessionDrained,
+        SessionDropped,
+        SessionOverflowed,
+        PacketRejected,
+        RoomJoined,
+        RoomLeft,
+        RoomRefused,
+        PublishRefused,
+        RoomRate,
+        TransferOffered,
+        TransferCompleted,
+        TransferFailed,
+        ClockEstimated,
+        LinkEstablished,
+        LinkFailed,
+        LinkRefused,
+        MessageDuplicate,
+        ServerDraining,
+        PoolSampled,
+        PeerTimedOut,
+        SessionThrottled,
+        SessionThrottleDropped,
+        SessionThrottleClosed,
+        ConnectionRejected,
+        AcceptPaused,
+        Count           /**< The number of events, not an event */
+    };
+
+    namespace Detail {
+        /**
+         * @struct Trace::Detail::EventInfo
+         * @brief The static description of an event
+         */
+        struct EventInfo {
+            Level level;
+            std::string_view format;    /**< fmtlib format string, only used by the collector */
+        };
+
+        /**
+         * @brief The event table, must be kept in the same order as Trace::Event
+         */
+        inline constexpr std::array<EventInfo, static_cast<std::size_t>(Event::Count)> events{{
+            { Level::Info,  "Constructed a server on port {}" },
+            { Level::Info,  "Starting client towards port {}" },
+            { Level::Info,  "Stopping server" },
+            { Level::Info,  "Stopping client" },
+            { Level::Info,  "Established a connection" },
+            { Level::Info,  "Lost a connection" },
+            { Level::Debug, "Transmitted {} bytes" },
+            { Level::Error, "Failed to transmit, error code {}" },
+            { Level::Debug, "Sent a message with ID {}" },
+            { Level::Debug, "Received a message with ID {}" },
+            { Level::Debug, "Received an acknowledgement for ID {}" },
+            { Level::Info,  "Session {} is congested with {} queued bytes" },
+            { Level::Info,  "Session {} drained to {} queued bytes" },
+            { Level::Debug, "Session {} dropped {} queued messages" },
+            { Level::Error, "Session {} stayed congested with {} queued bytes, disconnecting" },
+            { Level::Error, "Session {} announced a packet of {} bytes, disconnecting" },
+            { Level::Debug, "Session {} joined room {}, now {} members" },
+            { Level::Debug, "Session {} left room {}, now {} members" },
+            { Level::Debug, "Session {} can't join another room, it's in {} rooms and {} exist" },
+            { Level::Debug, "Session {} published {} bytes to a room it isn't a member of" },
+            { Level::Info,  "Room {} has {} members, {:.1f} messages/s, {:.0f} bytes/s" },
+            { Level::Info,  "Receiving transfer {} of {} bytes" },
+            { Level::Info,  "Received transfer {}, {} bytes" },
+            { Level::Error, "Transfer {} failed, error code {}" },
+            { Level::Debug, "Session {} clock offset {} ns, drift {:.3f} ppm, round trip {} ns" },
+            { Level::Info,  "Session {} linked to node {:x}" },
+            { Level::Error, "Link to peer {} failed, error code {}" },
+            { Level::Error, "Session {} sent a link hello but isn't a known server, disconnecting" },
+            { Level::Debug, "Session {} sent the duplicate message {:x}, acknowledged again" },
+            { Level::Info,  "Stopped accepting connections, draining {} sessions" },
+            { Level::Debug, "Receive buffers: {} slabs in use, {} cached, peak {}" },
+            { Level::Error, "Session {} received nothing for {} ms, disconnecting" },
+            { Level::Debug, "Session {} is over its rate limit, reading paused for {} us" },
+            { Level::Debug, "Session {} is over its rate limit, dropped a frame of {} bytes" },
+            { Level::Error, "Session {} is over its rate limit, disconnecting" },
+            { Level::Info,  "Rejected a connection, {} clients are connected" },
+            { Level::Debug, "Accepting paused for {} us" },
+        }};
+
+        /**
+         * @enum Trace::Detail::ArgKind
+         * @brief How a raw 64-bit argument should be interpreted by the collector, packed 2 bits per argument
+         */
+        enum class ArgKind : std::uint8_t {
+            Unsigned = 0,
+            Signed = 1,
+            Floating = 2
+        };
+
+        inline constexpr std::size_t MaxArgs = 4;
+
+        /**
+         * @struct Trace::Detail::Record
+         * @brief A single recorded event, kept at 48 bytes so that a ring slot never straddles more than one cache line pair
+         */
+        struct Record {
+            std::uint64_t ticks;
+            Event event;
+            std::uint8_t argc;
+            std::uint8_t kinds;
+            std::array<std::uint64_t, MaxArgs> args;
+        };
+
+        static_assert(sizeof(Record) == 48);
+        static_assert(std::is_trivially_copyable_v<Record>);
+
+        inline std::atomic<Level> level{
+        #ifdef DEBUG
+            Level::Debug
+        #else
+            Level::Info
+        #endif
+        };
+
+        /**
+         * @brief Reads a cheap, monotonic tick counter, the collector calibrates it against the wall clock
+         * @return the current tick
+         */
+        [[nodiscard]] inline std::uint64_t Now() noexcept {
+        #if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+        #else
+            return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        #endif
+        }
+
+        /**
+         * @brief Writes a record into the calling thread's ring, drops it (and counts the drop) if the ring is full
+         * @param record the record to store
+         */
+        void Push(Record const& record) noexcept;
+
+        template<typename T>
+        concept Argument = std::integral<T> || std::floating_point<T> || std::is_enum_v<T>;
+
+        template<Argument T>
+        [[nodiscard]] constexpr ArgKind KindOf() noexcept {
+            if constexpr (std::floating_point<T>)
+                return ArgKind::Floating;
+            else if constexpr (std::is_enum_v<T>)
+                return std::is_signed_v<std::underlying_type_t<T>> ? ArgKind::Signed : ArgKind::Unsigned;
+            else
+                return std::is_signed_v<T> ? ArgKind::Signed : ArgKind::Unsigned;
+        }
+
+        template<Argument T>
+        [[nodiscard]] constexpr std::uint64_t Raw(T value) noexcept {
+            if constexpr (std::floating_point<T>)
+                return std::bit_cast<std::uint64_t>(static_cast<double>(value));
+            else if constexpr (std::is_enum_v<T>)
+                return static_cast<std::uint64_t>(static_cast<std::int64_t>(static_cast<std::underlying_type_t<T>>(value)));
+            else
+                return static_cast<std::uint64_t>(static_cast<std::int64_t>(value));
+        }
+    }
+
+    /**
+     * @brief Changes the verbosity at runtime
+     * @param level the new level
+     */
+    inline void SetLevel(Level level) noexcept {
+        Detail::level.store(level, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return the current verbosity
+     */
+    [[nodiscard]] inline Level GetLevel() noexcept {
+        return Detail::level.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Checks whether an event would be recorded with the current verbosity
+     * @param event the event to check
+     * @return true if it's enabled
+     */
+    [[nodiscard]] inline bool Enabled(Event event) noexcept {
+        return Detail::events[static_cast<std::size_t>(event)].level <= GetLevel();
+    }
+
+    /**
+     * @brief Records an event, this is the hot path and does no formatting, allocation or locking
+     * @param event the event to record
+     * @param args up to four integral, floating point or enum arguments, matching the event's format string
+     */
+    template<Detail::Argument... Args>
+    inline void Emit(Event event, Args... args) noexcept {
+        static_assert(sizeof...(Args) <= Detail::MaxArgs, "A trace event holds at most four arguments");
+
+        if (!Enabled(event)) [[likely]]
+            return;
+
+        std::uint8_t kinds = 0;
+        std::uint8_t shift = 0;
+        ((kinds |= static_cast<std::uint8_t>(static_cast<std::uint8_t>(Detail::KindOf<Args>()) << shift), shift += 2), ...);
+
+        Detail::Push(Detail::Record{
+            .ticks = Detail::Now(),
+            .event = event,
+            .argc = static_cast<std::uint8_t>(sizeof...(Args)),
+            .kinds = kinds,
+            .args = { Detail::Raw(args)... }
+        });
+    }
+
+    /**
+     * @brief Parses a level from its name (off, error, info, debug)
+     * @param name the name of the level
+     * @param fallback returned if the name is unknown
+     * @return the parsed level
+     */
+    [[nodiscard]] Level ParseLevel(std::string_view name, Level fallback) noexcept;
+
+    /**
+     * @brief Redirects the formatted output to a file, it's written to stderr by default
+     * @param path the file to append to
+     * @return false if the file couldn't be opened, the previous sink is kept in that case
+     */
+    bool Open(std::string const& path);
+
+    /**
+     * @brief Blocks until every record that was emitted before the call has been formatted and written
+     */
+    void Flush();
+
+    /**
+     * @return the total number of records that were dropped because a ring was full
+     */
+    [[nodiscard]] std::uint64_t Dropped() noexcept;
+}
+
+#endif // CHATAPP_TRACE_HPP
@@ -0,0 +1,398 @@
+/**
+ * @file Transfer.cpp
+ * @brief Implements the chunked transfers
+ * @author Noak Palander
+ * @version 1.0
+ * @see Transfer.hpp
+ */
+
+#include "Transfer.hpp"
+
+#include "Trace.hpp"
+#include "Utf8.hpp"
+#include "Wire.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Chat {
+    namespace {
+        constexpr std::size_t OfferHeader = sizeof(std::uint32_t) + 1 + sizeof(std::uint64_t) * 2 + 1 + 1;
+        constexpr std::size_t ChunkHeaderSize = sizeof(std::uint32_t) + 1 + sizeof(std::uint64_t) * 2;
+
+        /**
+         * @brief Generates a transfer ID, it only has to be unique among the transfers in flight
+         */
+        std::uint64_t GenerateId() {
+            static thread_local std::mt19937_64 engine(std::random_device{}() ^
+                static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+            return engine();
+        }
+
+        template<Wire::Field T>
+        void Put(std::byte*& ptr, T value) {
+            Wire::Store(ptr, value);
+            ptr += sizeof(T);
+        }
+
+        template<Wire::Field T>
+        T Get(std::byte const*& ptr) {
+            auto const value = Wire::Load<T>(ptr);
+            ptr += sizeof(T);
+            return value;
+        }
+    }
+
+    OutgoingTransfer::OutgoingTransfer(std::filesystem::path const& path, std::string room)
+        :   id_{GenerateId()},
+            size_{0},
+            kind_{TransferKind::File},
+            name_{path.filename().string()},
+            room_{std::move(room)}
+    {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), path.string());
+
+        struct stat info{};
+        if (::fstat(fd_, &info) != 0 || !S_ISREG(info.st_mode)) {
+            int const error = errno != 0 ? errno : EINVAL;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), path.string());
+        }
+
+        size_ = static_cast<std::uint64_t>(info.st_size);
+        room_.resize(std::min<std::size_t>(room_.size(), 255));
+    }
+
+    OutgoingTransfer::OutgoingTransfer(std::string text, std::string room)
+        :   id_{GenerateId()},
+            size_{text.size()},
+            kind_{TransferKind::Text},
+            name_{"paste"},
+            room_{std::move(room)},
+            text_{std::move(text)}
+    {
+        room_.resize(std::min<std::size_t>(room_.size(), 255));
+    }
+
+    OutgoingTransfer::~OutgoingTransfer() {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    Packet OutgoingTransfer::Offer() const {
+        std::vector<std::byte> packet(OfferHeader + room_.size() + name_.size());
+        std::byte* ptr = packet.data();
+
+        Put(ptr, static_cast<std::uint32_t>(packet.size() - sizeof(std::uint32_t)));
+        Put(ptr, MessageType::Offer);
+        Put(ptr, id_);
+        Put(ptr, size_);
+        Put(ptr, kind_);
+        Put(ptr, static_cast<unsigned char>(room_.size()));
+        std::memcpy(ptr, room_.data(), room_.size());
+        ptr += room_.size();
+        std::memcpy(ptr, name_.data(), name_.size());
+
+        return std::make_shared<std::vector<std::byte> const>(std::move(packet));
+    }
+
+    std::vector<std::byte> OutgoingTransfer::ChunkHeader(std::uint64_t offset, std::size_t length) const {
+        std::vector<std::byte> header(ChunkHeaderSize);
+        std::byte* ptr = header.data();
+
+        Put(ptr, static_cast<std::uint32_t>(ChunkHeaderSize - sizeof(std::uint32_t) + length));
+        Put(ptr, MessageType::Chunk);
+        Put(ptr, id_);
+        Put(ptr, offset);
+
+        return header;
+    }
+
+    std::span<std::byte const> OutgoingTransfer::Payload(std::uint64_t offset, std::size_t length, std::vector<std::byte>& scratch) const {
+        if (kind_ == TransferKind::Text)
+            return std::as_bytes(std::span(text_)).subspan(offset, length);
+
+        scratch.resize(length);
+        std::size_t read = 0;
+
+        while (read < length) {
+            auto const result = ::pread(fd_, scratch.data() + read, length - read, static_cast<off_t>(offset + read));
+            if (result < 0 && errno == EINTR)
+                continue;
+
+            if (result < 0)
+                throw std::system_error(errno, std::generic_category(), name_);
+
+            // The file was truncated while it was being sent
+            if (result == 0)
+                break;
+
+            read += static_cast<std::size_t>(result);
+        }
+
+        return std::span<std::byte const>(scratch.data(), read);
+    }
+
+    IncomingTransfers::IncomingTransfers(std::filesystem::path downloads, std::size_t maxPerOrigin, std::uint64_t quota)
+        :   downloads_{std::move(downloads)},
+            maxPerOrigin_{maxPerOrigin},
+            quota_{quota} {}
+
+    std::optional<TransferProgress> IncomingTransfers::Open(TransferOffer const& offer, std::uint32_t origin) {
+        Key const key{ .origin = origin, .id = offer.id };
+        Incoming incoming{ .offer = offer, .origin = origin, .text = {}, .path = {} };
+
+        // A second offer with the ID of a live transfer would replace it, and leak its file
+        if (transfers_.contains(key)) {
+            Trace::Emit(Trace::Event::TransferFailed, offer.id, EEXIST);
+            return std::nullopt;
+        }
+
+        if (auto open = open_.find(origin); maxPerOrigin_ > 0 && open != open_.end() && open->second >= maxPerOrigin_) {
+            Trace::Emit(Trace::Event::TransferFailed, offer.id, EMFILE);
+            return Progress(incoming, true, true);
+        }
+
+        // Text isn't reserved up front, an offer is a few bytes while the size it announces can be large, it grows as the
+        // chunks arrive instead
+        if (offer.kind == TransferKind::Text) {
+            if (offer.size > MaxText)
+                return Progress(incoming, true, true);
+        }
+        // Without a directory the file is only followed, its chunks are relayed but not stored
+        else if (!downloads_.empty()) {
+            // The whole announced size is taken up front, a transfer can't write beyond it
+            if (quota_ > 0 && offer.size > quota_ - reserved_) {
+                Trace::Emit(Trace::Event::TransferFailed, offer.id, EDQUOT);
+                return Progress(incoming, true, true);
+            }
+
+            incoming.file = Create(offer, incoming.path);
+            if (!incoming.file) {
+                Trace::Emit(Trace::Event::TransferFailed, offer.id, errno);
+                return Progress(incoming, true, true);
+            }
+
+            reserved_ += offer.size;
+        }
+
+        Trace::Emit(Trace::Event::TransferOffered, offer.id, offer.size);
+        auto const progress = Progress(incoming, offer.size == 0, false);
+
+        // Empty transfers are complete without any chunks
+        if (offer.size == 0) {
+            Finish(incoming, false);
+            return progress;
+        }
+
+        transfers_.emplace(key, std::move(incoming));
+        ++open_[origin];
+        return progress;
+    }
+
+    std::optional<TransferProgress> IncomingTransfers::Write(TransferChunk const& chunk, std::uint32_t origin) {
+        auto iter = transfers_.find(Key{ .origin = origin, .id = chunk.id });
+        if (iter == transfers_.end())
+            return std::nullopt;
+
+        Incoming& incoming = iter->second;
+
+        // Chunks arrive in order over a single connection, anything else is a broken peer
+        if (chunk.offset != incoming.received || incoming.received + chunk.payload.size() > incoming.offer.size) {
+            Trace::Emit(Trace::Event::TransferFailed, chunk.id, EPROTO);
+            auto const progress = Progress(incoming, true, true);
+            Finish(incoming, true);
+            Forget(iter);
+            return progress;
+        }
+
+        if (incoming.file) {
+            if (std::fwrite(chunk.payload.data(), 1, chunk.payload.size(), incoming.file) != chunk.payload.size()) {
+                Trace::Emit(Trace::Event::TransferFailed, chunk.id, errno);
+                auto const progress = Progress(incoming, true, true);
+                Finish(incoming, true);
+                Forget(iter);
+                return progress;
+            }
+        }
+        else if (incoming.offer.kind == TransferKind::Text) {
+            incoming.text.append(reinterpret_cast<char const*>(chunk.payload.data()), chunk.payload.size());
+        }
+
+        incoming.received += chunk.payload.size();
+
+        if (incoming.received < incoming.offer.size)
+            return Progress(incoming, false, false);
+
+        Trace::Emit(Trace::Event::TransferCompleted, chunk.id, incoming.received);
+        auto const progress = Progress(incoming, true, false);
+        Finish(incoming, false);
+        Forget(iter);
+        return progress;
+    }
+
+    std::string IncomingTransfers::TakeText(std::uint64_t id, std::uint32_t origin) {
+        auto node = completed_.extract(Key{ .origin = origin, .id = id });
+        return node.empty() ? std::string() : std::move(node.mapped());
+    }
+
+    std::vector<TransferProgress> IncomingTransfers::Abort(std::uint32_t origin) {
+        std::vector<TransferProgress> aborted;
+
+        for (auto iter = transfers_.begin(); iter != transfers_.end();) {
+            auto& incoming = iter->second;
+            if (incoming.origin != origin) {
+                ++iter;
+                continue;
+            }
+
+            aborted.push_back(Progress(incoming, true, true));
+            Finish(incoming, true);
+            iter = transfers_.erase(iter);
+        }
+
+        open_.erase(origin);
+        return aborted;
+    }
+
+    std::optional<std::string> IncomingTransfers::Room(std::uint64_t id, std::uint32_t origin) const {
+        auto iter = transfers_.find(Key{ .origin = origin, .id = id });
+        if (iter == transfers_.end())
+            return std::nullopt;
+
+        return iter->second.offer.room;
+    }
+
+    std::FILE* IncomingTransfers::Create(TransferOffer const& offer, std::filesystem::path& path) const {
+        // The directory must be ours alone, otherwise anyone could plant files or symlinks in it
+        std::error_code ec;
+        std::filesystem::create_directories(downloads_.parent_path(), ec);
+        if (::mkdir(downloads_.c_str(), 0700) != 0 && errno != EEXIST)
+            return nullptr;
+
+        struct stat info{};
+        if (::lstat(downloads_.c_str(), &info) != 0)
+            return nullptr;
+
+        if (!S_ISDIR(info.st_mode) || info.st_uid != ::geteuid()) {
+            errno = EACCES;
+            return nullptr;
+        }
+
+        // Only the file name is used, a peer can't choose where the file is written
+        auto name = std::filesystem::path(offer.name).filename().string();
+        if (name.empty() || name == "." || name == "..")
+            name = "download";
+
+        // An existing file is never opened, let alone truncated, the name is made unique instead
+        for (unsigned attempt = 0; attempt < 16; ++attempt) {
+            path = downloads_ / (attempt == 0 ? name : std::to_string(offer.id) + "-" + std::to_string(attempt) + "-" + name);
+
+            int const fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (fd < 0 && errno == EEXIST)
+                continue;
+
+            if (fd < 0)
+                return nullptr;
+
+            if (auto* file = ::fdopen(fd, "wb"))
+                return file;
+
+            int const error = errno;
+            ::close(fd);
+            std::filesystem::remove(path, ec);
+            errno = error;
+            return nullptr;
+        }
+
+        errno = EEXIST;
+        return nullptr;
+    }
+
+    void IncomingTransfers::Finish(Incoming& incoming, bool failed) {
+        if (incoming.file) {
+            std::fclose(incoming.file);
+            incoming.file = nullptr;
+
+            if (failed) {
+                std::error_code ec;
+                std::filesystem::remove(incoming.path, ec);
+                reserved_ -= incoming.offer.size;
+            }
+        }
+        else if (!failed && incoming.offer.kind == TransferKind::Text) {
+            completed_.insert_or_assign(Key{ .origin = incoming.origin, .id = incoming.offer.id }, std::move(incoming.text));
+        }
+    }
+
+    void IncomingTransfers::Forget(std::unordered_map<Key, Incoming, KeyHash>::iterator iter) {
+        auto const origin = iter->first.origin;
+        transfers_.erase(iter);
+
+        if (auto open = open_.find(origin); open != open_.end() && --open->second == 0)
+            open_.erase(open);
+    }
+
+    TransferProgress IncomingTransfers::Progress(Incoming const& incoming, bool done, bool failed) const {
+        return TransferProgress{
+            .id = incoming.offer.id,
+            .name = incoming.offer.name,
+            .room = incoming.offer.room,
+            .kind = incoming.offer.kind,
+            .bytes = incoming.received,
+            .size = incoming.offer.size,
+            .outgoing = false,
+            .done = done,
+            .failed = failed,
+            .path = incoming.path
+        };
+    }
+
+    std::filesystem::path DefaultDownloads() {
+        return std::filesystem::temp_directory_path() / ("ChatApp-" + std::to_string(::geteuid()));
+    }
+
+    std::optional<TransferOffer> DecodeOffer(std::span<std::byte const> packet) {
+        if (packet.size() < OfferHeader)
+            return std::nullopt;
+
+        std::byte const* ptr = packet.data() + sizeof(std::uint32_t) + 1;
+        TransferOffer offer{};
+        offer.id = Get<std::uint64_t>(ptr);
+        offer.size = Get<std::uint64_t>(ptr);
+        offer.kind = Get<TransferKind>(ptr);
+
+        auto const roomLength = static_cast<std::size_t>(Get<unsigned char>(ptr));
+        if (packet.size() < OfferHeader + roomLength || offer.kind > TransferKind::File)
+            return std::nullopt;
+
+        offer.room.assign(reinterpret_cast<char const*>(ptr), roomLength);
+        ptr += roomLength;
+        offer.name.assign(reinterpret_cast<char const*>(ptr), reinterpret_cast<char const*>(std::to_address(packet.end())));
+
+        // Both are displayed, and the name becomes part of a path
+        Utf8::Sanitize(offer.room);
+        Utf8::Sanitize(offer.name);
+        return offer;
+    }
+
+    std::optional<TransferChunk> DecodeChunk(std::span<std::byte const> packet) {
+        if (packet.size() < ChunkHeaderSize)
+            return std::nullopt;
+
+        std::byte const* ptr = packet.data() + sizeof(std::uint32_t) + 1;
+        TransferChunk chunk{};
+        chunk.id = Get<std::uint64_t>(ptr);
+        chunk.offset = Get<std::uint64_t>(ptr);
+        chunk.payload = std::span<std::byte const>(packet).subspan(ChunkHeaderSize);
+        return chunk;
+    }
+}
@@ -0,0 +1,288 @@
+/**
+ * @file Transfer.hpp
+ * @brief Contains the chunked transfer of large pastes and files, which is interleaved with the chat traffic
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * A transfer is announced by an offer packet, followed by fixed-size chunk packets:
+ * Offer: 4B = length, 1B = type (Offer), 8B = transfer ID, 8B = total size, 1B = kind (Text/File),
+ *        1B = length of the room name, xB = room name, remainder = name of the file
+ * Chunk: 4B = length, 1B = type (Chunk), 8B = transfer ID, 8B = offset, remainder = payload
+ */
+
+#ifndef CHATAPP_TRANSFER_HPP
+#define CHATAPP_TRANSFER_HPP
+
+#include "Message.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Chat {
+    /**
+     * @enum Chat::TransferKind
+     * @brief What's being transferred, decides what happens when the transfer completes
+     * @author Noak Palander
+     */
+    enum class TransferKind : unsigned char {
+        Text = 0,   /**< A large paste, delivered as a regular new message once complete */
+        File = 1    /**< A file, written to the download directory */
+    };
+
+    /**
+     * @struct Chat::TransferProgress
+     * @brief Reports the progress of a transfer in either direction
+     * @author Noak Palander
+     */
+    struct TransferProgress {
+        std::uint64_t id;
+        std::string name;
+        std::string room;
+        TransferKind kind;
+        std::uint64_t bytes;                /**< Bytes sent or received so far */
+        std::uint64_t size;                 /**< The total size */
+        bool outgoing;
+        bool done;
+        bool failed;
+        std::filesystem::path path;         /**< Where a received file was written */
+    };
+
+    /**
+     * @struct Chat::TransferOffer
+     * @brief A decoded offer packet
+     * @author Noak Palander
+     */
+    struct TransferOffer {
+        std::uint64_t id;
+        std::uint64_t size;
+        TransferKind kind;
+        std::string room;
+        std::string name;
+    };
+
+    /**
+     * @struct Chat::TransferChunk
+     * @brief A decoded chunk packet, the payload refers into the packet
+     * @author Noak Palander
+     */
+    struct TransferChunk {
+        std::uint64_t id;
+        std::uint64_t offset;
+        std::span<std::byte const> payload;
+    };
+
+    /**
+     * @class Chat::OutgoingTransfer
+     * @brief The immutable source of a transfer, shared by every session it's sent on, each of which keeps its own offset
+     * @author Noak Palander
+     */
+    class OutgoingTransfer {
+    public:
+        /**
+         * @brief The payload size of every chunk but the last, also bounds how long a chat message can wait behind a transfer
+         */
+        static constexpr std::size_t ChunkSize = 64 * 1024;
+
+        /**
+         * @brief Opens a file to be transferred, the file is sent straight from the descriptor
+         * @param path the file to send
+         * @param room the room the transfer is published to
+         * @throws std::system_error if the file can't be opened
+         */
+        OutgoingTransfer(std::filesystem::path const& path, std::string room);
+
+        /**
+         * @brief Prepares a large paste to be transferred
+         * @param text the contents
+         * @param room the room the transfer is published to
+         */
+        OutgoingTransfer(std::string text, std::string room);
+
+        OutgoingTransfer(OutgoingTransfer const&) = delete;
+        OutgoingTransfer& operator=(OutgoingTransfer const&) = delete;
+
+        ~OutgoingTransfer();
+
+        /**
+         * @return the serialized offer, sent before the first chunk
+         */
+        [[nodiscard]] Packet Offer() const;
+
+        /**
+         * @brief Serializes the header of a chunk, the payload is written separately
+         * @param offset the offset of the chunk
+         * @param length the payload length of the chunk
+         * @return the length prefix, type, ID and offset
+         */
+        [[nodiscard]] std::vector<std::byte> ChunkHeader(std::uint64_t offset, std::size_t length) const;
+
+        /**
+         * @brief Provides a chunk's payload, used for text and when zero-copy isn't available
+         * @param offset the offset of the chunk
+         * @param length the payload length of the chunk
+         * @param scratch files are read into this buffer, text refers directly into the transfer
+         * @return the payload, shorter than requested if the file was truncated
+         * @throws std::system_error if the file can't be read
+         */
+        [[nodiscard]] std::span<std::byte const> Payload(std::uint64_t offset, std::size_t length, std::vector<std::byte>& scratch) const;
+
+        [[nodiscard]] std::uint64_t Identifier() const noexcept { return id_; }
+        [[nodiscard]] std::uint64_t Size() const noexcept { return size_; }
+        [[nodiscard]] TransferKind Kind() const noexcept { return kind_; }
+        [[nodiscard]] std::string const& Name() const noexcept { return name_; }
+        [[nodiscard]] std::string const& Room() const noexcept { return room_; }
+
+        /**
+         * @return the descriptor of the file, or -1 for text
+         */
+        [[nodiscard]] int Descriptor() const noexcept { return fd_; }
+
+    private:
+        std::uint64_t id_;
+        std::uint64_t size_;
+        TransferKind kind_;
+        std::string name_;
+        std::string room_;
+        std::string text_;
+        int fd_ = -1;
+    };
+
+    /**
+     * @class Chat::IncomingTransfers
+     * @brief Reassembles every transfer that's currently being received
+     * @author Noak Palander
+     *
+     * Transfer IDs are chosen by the sender, so a transfer is identified by the session it's received on together with its ID,
+     * a session can't write into or replace the transfers of another.
+     *
+     * Files are created exclusively in a directory owned by us, without following symlinks, and the bytes written to it are
+     * bounded by a quota. Without a directory, files are only followed so that they can be relayed, and aren't stored.
+     */
+    class IncomingTransfers {
+    public:
+        /**
+         * @brief The largest text transfer accepted, text is reassembled in memory as its chunks arrive
+         */
+        static constexpr std::uint64_t MaxText = 64 * 1024 * 1024;
+
+        /**
+         * @param downloads the directory received files are written to, it's created accessible to us only, files aren't
+         * stored when it's empty
+         * @param maxPerOrigin the most transfers received on a single session at once, 0 is unlimited
+         * @param quota the most bytes of files written to the directory, failed transfers give theirs back, 0 is unlimited
+         */
+        IncomingTransfers(std::filesystem::path downloads, std::size_t maxPerOrigin, std::uint64_t quota);
+
+        /**
+         * @brief Starts receiving a transfer
+         * @param offer the decoded offer
+         * @param origin the session it's received on, used to abort it if the session is closed
+         * @return the initial progress, failed if the transfer can't be received, or nothing if the session already
+         * receives a transfer with the same ID
+         */
+        std::optional<TransferProgress> Open(TransferOffer const& offer, std::uint32_t origin);
+
+        /**
+         * @brief Stores a chunk of a transfer
+         * @param chunk the decoded chunk
+         * @param origin the session it's received on
+         * @return the progress, or nothing if the session doesn't receive such a transfer
+         */
+        std::optional<TransferProgress> Write(TransferChunk const& chunk, std::uint32_t origin);
+
+        /**
+         * @brief Takes the contents of a completed text transfer
+         * @param id the transfer
+         * @param origin the session it was received on
+         * @return the contents
+         */
+        std::string TakeText(std::uint64_t id, std::uint32_t origin);
+
+        /**
+         * @brief Aborts every transfer received on a session, partially received files are removed
+         * @param origin the closed session
+         * @return the progress of every aborted transfer
+         */
+        std::vector<TransferProgress> Abort(std::uint32_t origin);
+
+        /**
+         * @param id the transfer
+         * @param origin the session it's received on
+         * @return the room of a transfer that's being received, or nothing if it's unknown
+         */
+        [[nodiscard]] std::optional<std::string> Room(std::uint64_t id, std::uint32_t origin) const;
+
+    private:
+        struct Key {
+            std::uint32_t origin;
+            std::uint64_t id;
+
+            bool operator==(Key const&) const = default;
+        };
+
+        struct KeyHash {
+            std::size_t operator()(Key const& key) const noexcept { return std::hash<std::uint64_t>()(key.id ^ (std::uint64_t{key.origin} << 32)); }
+        };
+
+        struct Incoming {
+            TransferOffer offer;
+            std::uint32_t origin;
+            std::uint64_t received = 0;
+            std::string text;
+            std::filesystem::path path;
+            std::FILE* file = nullptr;
+        };
+
+        /**
+         * @brief Internal, creates a file for a transfer, retrying with another name while one already exists
+         * @return the file, or nullptr with errno set
+         */
+        std::FILE* Create(TransferOffer const& offer, std::filesystem::path& path) const;
+
+        /**
+         * @brief Internal, closes a transfer, completed text is kept until it's taken, a failed file gives back its quota
+         */
+        void Finish(Incoming& incoming, bool failed);
+
+        /**
+         * @brief Internal, removes a finished transfer, and releases its place among the transfers of its session
+         */
+        void Forget(std::unordered_map<Key, Incoming, KeyHash>::iterator iter);
+
+        TransferProgress Progress(Incoming const& incoming, bool done, bool failed) const;
+
+        std::filesystem::path downloads_;
+        std::size_t maxPerOrigin_;
+        std::uint64_t quota_;
+        std::uint64_t reserved_ = 0;                                   /**< Bytes of the quota taken by the files being or already received */
+        std::unordered_map<Key, Incoming, KeyHash> transfers_;
+        std::unordered_map<std::uint32_t, std::size_t> open_;          /**< The number of transfers being received on every session */
+        std::unordered_map<Key, std::string, KeyHash> completed_;     /**< Completed text, until it's taken */
+    };
+
+    /**
+     * @return the default directory for received files, a directory of the current user's under the temporary directory
+     */
+    [[nodiscard]] std::filesystem::path DefaultDownloads();
+
+    /**
+     * @brief Decodes an offer packet
+     * @param packet the packet, including the length prefix
+     * @return the offer, or nothing if it's malformed
+     */
+    [[nodiscard]] std::optional<TransferOffer> DecodeOffer(std::span<std::byte const> packet);
+
+    /**
+     * @brief Decodes a chunk packet
+     * @param packet the packet, including the length prefix
+     * @return the chunk, or nothing if it's malformed
+     */
+    [[nodiscard]] std::optional<TransferChunk> DecodeChunk(std::span<std::byte const> packet);
+}
+
+#endif // CHATAPP_TRANSFER_HPP
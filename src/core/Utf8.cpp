@@ -0,0 +1,350 @@
+/**
+ * @file Utf8.cpp
+ * @brief Implements the validation and sanitization of text received from peers
+ * @author Noak Palander
+ * @version 1.0
+ * @see Utf8.hpp
+ *
+ * The vectorized validation classifies every byte by its own high nibble and the nibbles of the byte before it,
+ * with three 16-entry lookups, so a block is validated without branching on its contents.
+ * See Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+ */
+
+#include "Utf8.hpp"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define CHATAPP_UTF8_X86
+    #include <immintrin.h>
+#endif
+
+namespace Chat::Utf8 {
+    namespace {
+        constexpr std::string_view Replacement = "\xEF\xBF\xBD";
+
+        constexpr bool Control(unsigned char c) noexcept {
+            return (c < 0x20 && c != '\t' && c != '\n') || c == 0x7f;
+        }
+
+        constexpr bool Continuation(unsigned char c) noexcept {
+            return (c & 0xc0) == 0x80;
+        }
+
+        /**
+         * @brief The length of the well-formed sequence at the start of the text, see table 3-7 of the Unicode standard
+         * @return 0 if it's malformed or truncated
+         */
+        std::size_t Sequence(unsigned char const* data, std::size_t size) noexcept {
+            unsigned char const lead = data[0];
+            if (lead < 0x80)
+                return 1;
+
+            // Continuations, overlong two byte sequences and leads beyond U+10FFFF
+            if (lead < 0xc2 || lead > 0xf4)
+                return 0;
+
+            if (lead < 0xe0)
+                return size >= 2 && Continuation(data[1]) ? 2 : 0;
+
+            // The second byte excludes overlong sequences, surrogates and code points beyond U+10FFFF
+            unsigned char const low = lead == 0xe0 ? 0xa0 : lead == 0xf0 ? 0x90 : 0x80;
+            unsigned char const high = lead == 0xed ? 0x9f : lead == 0xf4 ? 0x8f : 0xbf;
+            std::size_t const length = lead < 0xf0 ? 3 : 4;
+
+            if (size < length || data[1] < low || data[1] > high)
+                return 0;
+
+            for (std::size_t i = 2; i < length; ++i) {
+                if (!Continuation(data[i]))
+                    return 0;
+            }
+
+            return length;
+        }
+
+        TextKind ScanScalar(unsigned char const* data, std::size_t size) noexcept {
+            bool ascii = true;
+
+            for (std::size_t i = 0; i < size;) {
+                if (data[i] < 0x80) {
+                    if (Control(data[i]))
+                        return TextKind::Unsafe;
+                    ++i;
+                    continue;
+                }
+
+                std::size_t const length = Sequence(data + i, size - i);
+                if (length == 0)
+                    return TextKind::Unsafe;
+
+                ascii = false;
+                i += length;
+            }
+
+            return ascii ? TextKind::Ascii : TextKind::Unicode;
+        }
+
+#ifdef CHATAPP_UTF8_X86
+        /**
+         * @brief The error classes of a pair of bytes, a pair is malformed if its three lookups share a class
+         */
+        enum : unsigned char {
+            TooShort = 1 << 0,      /**< A lead followed by a lead or by ASCII */
+            TooLong = 1 << 1,       /**< ASCII followed by a continuation */
+            Overlong3 = 1 << 2,     /**< 11100000 100_____ */
+            TooLarge = 1 << 3,      /**< 11110100 1001____ and above */
+            Surrogate = 1 << 4,     /**< 11101101 101_____ */
+            Overlong2 = 1 << 5,     /**< 1100000_ 10______ */
+            TooLarge1000 = 1 << 6,  /**< 11110101 1000____ and above */
+            Overlong4 = 1 << 6,     /**< 11110000 1000____ */
+            TwoContinuations = 1 << 7,
+            Carry = TooShort | TooLong | TwoContinuations
+        };
+
+        /**
+         * @brief The classes of a pair by the high nibble of its first byte
+         */
+        constexpr unsigned char FirstHigh[16] = {
+            TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+            TwoContinuations, TwoContinuations, TwoContinuations, TwoContinuations,
+            TooShort | Overlong2,
+            TooShort,
+            TooShort | Overlong3 | Surrogate,
+            TooShort | TooLarge | TooLarge1000 | Overlong4
+        };
+
+        /**
+         * @brief The classes of a pair by the low nibble of its first byte
+         */
+        constexpr unsigned char FirstLow[16] = {
+            Carry | Overlong3 | Overlong2 | Overlong4,
+            Carry | Overlong2,
+            Carry,
+            Carry,
+            Carry | TooLarge,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000 | Surrogate,
+            Carry | TooLarge | TooLarge1000,
+            Carry | TooLarge | TooLarge1000
+        };
+
+        /**
+         * @brief The classes of a pair by the high nibble of its second byte
+         */
+        constexpr unsigned char SecondHigh[16] = {
+            TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+            TooLong | Overlong2 | TwoContinuations | Overlong3 | TooLarge1000 | Overlong4,
+            TooLong | Overlong2 | TwoContinuations | Overlong3 | TooLarge,
+            TooLong | Overlong2 | TwoContinuations | Surrogate | TooLarge,
+            TooLong | Overlong2 | TwoContinuations | Surrogate | TooLarge,
+            TooShort, TooShort, TooShort, TooShort
+        };
+
+        /**
+         * @brief A block ending in a lead that still needs this many continuations is incomplete
+         */
+        constexpr unsigned char Incomplete[3] = { 0xf0 - 1, 0xe0 - 1, 0xc0 - 1 };
+
+        [[gnu::target("ssse3")]]
+        TextKind ScanSsse3(unsigned char const* data, std::size_t size) noexcept {
+            constexpr std::size_t Width = 16;
+
+            __m128i const firstHigh = _mm_loadu_si128(reinterpret_cast<__m128i const*>(FirstHigh));
+            __m128i const firstLow = _mm_loadu_si128(reinterpret_cast<__m128i const*>(FirstLow));
+            __m128i const secondHigh = _mm_loadu_si128(reinterpret_cast<__m128i const*>(SecondHigh));
+            __m128i const nibble = _mm_set1_epi8(0x0f);
+
+            unsigned char limits[Width];
+            std::memset(limits, 0xff, Width);
+            std::memcpy(limits + Width - sizeof(Incomplete), Incomplete, sizeof(Incomplete));
+            __m128i const incompleteLimit = _mm_loadu_si128(reinterpret_cast<__m128i const*>(limits));
+
+            __m128i error = _mm_setzero_si128();
+            __m128i incomplete = _mm_setzero_si128();
+            __m128i controls = _mm_setzero_si128();
+            __m128i previous = _mm_setzero_si128();
+            int high = 0;
+
+            for (std::size_t offset = 0; offset < size; offset += Width) {
+                __m128i input;
+                if (size - offset >= Width) {
+                    input = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + offset));
+                }
+                else {
+                    // The tail is padded with spaces, which are neither controls nor part of a sequence
+                    unsigned char tail[Width];
+                    std::memset(tail, ' ', Width);
+                    std::memcpy(tail, data + offset, size - offset);
+                    input = _mm_loadu_si128(reinterpret_cast<__m128i const*>(tail));
+                }
+
+                // Unsigned bytes up to 0x1f, except tabs and newlines, and DEL
+                __m128i const low = _mm_cmpeq_epi8(_mm_min_epu8(input, _mm_set1_epi8(0x1f)), input);
+                __m128i const allowed = _mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(input, _mm_set1_epi8('\n')));
+                controls = _mm_or_si128(controls, _mm_or_si128(_mm_andnot_si128(allowed, low), _mm_cmpeq_epi8(input, _mm_set1_epi8(0x7f))));
+
+                int const mask = _mm_movemask_epi8(input);
+                high |= mask;
+
+                // An ASCII block only has to complete the sequence the previous block ended with
+                if (mask == 0) {
+                    error = _mm_or_si128(error, incomplete);
+                    previous = input;
+                    continue;
+                }
+
+                __m128i const previous1 = _mm_alignr_epi8(input, previous, Width - 1);
+                __m128i const classes = _mm_and_si128(_mm_and_si128(
+                    _mm_shuffle_epi8(firstHigh, _mm_and_si128(_mm_srli_epi16(previous1, 4), nibble)),
+                    _mm_shuffle_epi8(firstLow, _mm_and_si128(previous1, nibble))),
+                    _mm_shuffle_epi8(secondHigh, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+                // The third and fourth bytes of a sequence must be continuations, and only those may follow a continuation
+                __m128i const third = _mm_subs_epu8(_mm_alignr_epi8(input, previous, Width - 2), _mm_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+                __m128i const fourth = _mm_subs_epu8(_mm_alignr_epi8(input, previous, Width - 3), _mm_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+                __m128i const continued = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+
+                error = _mm_or_si128(error, _mm_xor_si128(continued, classes));
+                incomplete = _mm_subs_epu8(input, incompleteLimit);
+                previous = input;
+            }
+
+            error = _mm_or_si128(_mm_or_si128(error, incomplete), controls);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xffff)
+                return TextKind::Unsafe;
+
+            return high == 0 ? TextKind::Ascii : TextKind::Unicode;
+        }
+
+        [[gnu::target("avx2")]]
+        TextKind ScanAvx2(unsigned char const* data, std::size_t size) noexcept {
+            constexpr std::size_t Width = 32;
+
+            // The lookups shuffle within each 128-bit lane, so both lanes hold the table
+            __m256i const firstHigh = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(FirstHigh)));
+            __m256i const firstLow = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(FirstLow)));
+            __m256i const secondHigh = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(SecondHigh)));
+            __m256i const nibble = _mm256_set1_epi8(0x0f);
+
+            unsigned char limits[Width];
+            std::memset(limits, 0xff, Width);
+            std::memcpy(limits + Width - sizeof(Incomplete), Incomplete, sizeof(Incomplete));
+            __m256i const incompleteLimit = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(limits));
+
+            __m256i error = _mm256_setzero_si256();
+            __m256i incomplete = _mm256_setzero_si256();
+            __m256i controls = _mm256_setzero_si256();
+            __m256i previous = _mm256_setzero_si256();
+            int high = 0;
+
+            for (std::size_t offset = 0; offset < size; offset += Width) {
+                __m256i input;
+                if (size - offset >= Width) {
+                    input = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + offset));
+                }
+                else {
+                    unsigned char tail[Width];
+                    std::memset(tail, ' ', Width);
+                    std::memcpy(tail, data + offset, size - offset);
+                    input = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(tail));
+                }
+
+                __m256i const low = _mm256_cmpeq_epi8(_mm256_min_epu8(input, _mm256_set1_epi8(0x1f)), input);
+                __m256i const allowed = _mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\t')), _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n')));
+                controls = _mm256_or_si256(controls, _mm256_or_si256(_mm256_andnot_si256(allowed, low), _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7f))));
+
+                int const mask = _mm256_movemask_epi8(input);
+                high |= mask;
+
+                if (mask == 0) {
+                    error = _mm256_or_si256(error, incomplete);
+                    previous = input;
+                    continue;
+                }
+
+                // The bytes before each position, across the lane boundary and from the previous block
+                __m256i const carried = _mm256_permute2x128_si256(previous, input, 0x21);
+                __m256i const previous1 = _mm256_alignr_epi8(input, carried, 16 - 1);
+                __m256i const classes = _mm256_and_si256(_mm256_and_si256(
+                    _mm256_shuffle_epi8(firstHigh, _mm256_and_si256(_mm256_srli_epi16(previous1, 4), nibble)),
+                    _mm256_shuffle_epi8(firstLow, _mm256_and_si256(previous1, nibble))),
+                    _mm256_shuffle_epi8(secondHigh, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+                __m256i const third = _mm256_subs_epu8(_mm256_alignr_epi8(input, carried, 16 - 2), _mm256_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+                __m256i const fourth = _mm256_subs_epu8(_mm256_alignr_epi8(input, carried, 16 - 3), _mm256_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+                __m256i const continued = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+                error = _mm256_or_si256(error, _mm256_xor_si256(continued, classes));
+                incomplete = _mm256_subs_epu8(input, incompleteLimit);
+                previous = input;
+            }
+
+            error = _mm256_or_si256(_mm256_or_si256(error, incomplete), controls);
+            if (!_mm256_testz_si256(error, error))
+                return TextKind::Unsafe;
+
+            return high == 0 ? TextKind::Ascii : TextKind::Unicode;
+        }
+#endif
+    }
+
+    TextKind Scan(std::string_view text) noexcept {
+        auto const* data = reinterpret_cast<unsigned char const*>(text.data());
+
+#ifdef CHATAPP_UTF8_X86
+        // Picks the widest implementation the CPU supports, once
+        static auto const scan = [] {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return &ScanAvx2;
+            if (__builtin_cpu_supports("ssse3"))
+                return &ScanSsse3;
+            return &ScanScalar;
+        }();
+
+        return scan(data, text.size());
+#else
+        return ScanScalar(data, text.size());
+#endif
+    }
+
+    TextKind Sanitize(std::string& text) {
+        if (auto const kind = Scan(text); kind != TextKind::Unsafe)
+            return kind;
+
+        auto const* data = reinterpret_cast<unsigned char const*>(text.data());
+        std::string repaired;
+        repaired.reserve(text.size());
+        bool ascii = true;
+
+        for (std::size_t i = 0; i < text.size();) {
+            if (data[i] < 0x80) {
+                if (!Control(data[i]))
+                    repaired += static_cast<char>(data[i]);
+                ++i;
+                continue;
+            }
+
+            ascii = false;
+            if (std::size_t const length = Sequence(data + i, text.size() - i); length > 0) {
+                repaired.append(text, i, length);
+                i += length;
+            }
+            else {
+                repaired += Replacement;
+                ++i;
+            }
+        }
+
+        text = std::move(repaired);
+        return ascii ? TextKind::Ascii : TextKind::Unicode;
+    }
+}
@@ -0,0 +1,44 @@
+/**
+ * @file Utf8.hpp
+ * @brief Contains the validation and sanitization of text received from peers
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_UTF8_HPP
+#define CHATAPP_UTF8_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace Chat {
+    /**
+     * @enum Chat::TextKind
+     * @brief What a scan found in a piece of text
+     * @author Noak Palander
+     */
+    enum class TextKind : std::uint8_t {
+        Ascii,      /**< Only printable 7-bit characters, tabs and newlines, converts to UTF-16 byte by byte */
+        Unicode,    /**< Valid UTF-8 with multi-byte characters, and no control characters */
+        Unsafe      /**< Malformed UTF-8 or control characters, has to be sanitized before it's displayed */
+    };
+
+    namespace Utf8 {
+        /**
+         * @brief Validates UTF-8 and looks for control characters, with SSSE3 or AVX2 when the CPU supports them
+         * @param text the text to scan
+         * @return what the text contains
+         */
+        [[nodiscard]] TextKind Scan(std::string_view text) noexcept;
+
+        /**
+         * @brief Repairs text in place, every malformed byte is replaced by U+FFFD and control characters are removed
+         * @param text the text to sanitize, it's left untouched if the scan finds nothing to repair
+         * @return TextKind::Ascii or TextKind::Unicode, describing the sanitized text
+         */
+        TextKind Sanitize(std::string& text);
+    }
+}
+
+#endif // CHATAPP_UTF8_HPP
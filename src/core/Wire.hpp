@@ -0,0 +1,155 @@
+/**
+ * @file Wire.hpp
+ * @brief Contains the byte order of every frame, and the fixed layout of the Chat::Message header
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * Every integer on the wire is little-endian, regardless of the host. On little-endian hosts a field is loaded or
+ * stored as-is, and the whole message header is a single copy, big-endian hosts byte-swap each field.
+ */
+
+#ifndef CHATAPP_WIRE_HPP
+#define CHATAPP_WIRE_HPP
+
+#include "Message.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+
+namespace Chat::Wire {
+    /**
+     * @brief Anything that is sent as a fixed-size integer
+     */
+    template<typename T>
+    concept Field = std::is_integral_v<T> || std::is_enum_v<T>;
+
+    /**
+     * @brief Reverses the bytes of a field, the shifts are recognized as a single instruction by the compilers
+     */
+    template<Field T>
+    [[nodiscard]] constexpr T ByteSwap(T value) noexcept {
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+
+        if constexpr (sizeof(T) == 1) {
+            return value;
+        }
+        else if constexpr (sizeof(T) == 2) {
+            auto const bits = static_cast<std::uint16_t>(value);
+            return static_cast<T>(static_cast<std::uint16_t>((bits >> 8) | (bits << 8)));
+        }
+        else if constexpr (sizeof(T) == 4) {
+            auto const bits = static_cast<std::uint32_t>(value);
+            return static_cast<T>((bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24));
+        }
+        else {
+            auto const bits = static_cast<std::uint64_t>(value);
+            auto const low = ByteSwap(static_cast<std::uint32_t>(bits));
+            auto const high = ByteSwap(static_cast<std::uint32_t>(bits >> 32));
+            return static_cast<T>((static_cast<std::uint64_t>(low) << 32) | high);
+        }
+    }
+
+    /**
+     * @brief Converts a field between the host and the wire byte order, it's its own inverse
+     */
+    template<Field T>
+    [[nodiscard]] constexpr T Little(T value) noexcept {
+        static_assert(std::endian::native == std::endian::little || std::endian::native == std::endian::big,
+                      "Mixed-endian hosts aren't supported");
+
+        if constexpr (std::endian::native == std::endian::little)
+            return value;
+        else
+            return ByteSwap(value);
+    }
+
+    /**
+     * @brief Reads a field from an unaligned position of a frame
+     */
+    template<Field T>
+    [[nodiscard]] T Load(std::byte const* ptr) noexcept {
+        T value;
+        std::memcpy(&value, ptr, sizeof(T));
+        return Little(value);
+    }
+
+    /**
+     * @brief Writes a field to an unaligned position of a frame
+     */
+    template<Field T>
+    void Store(std::byte* ptr, T value) noexcept {
+        value = Little(value);
+        std::memcpy(ptr, &value, sizeof(T));
+    }
+
+    /**
+     * @brief The version of the message header, a message of another version is rejected
+     */
+    inline constexpr std::uint8_t Version = 1;
+
+    /**
+     * @struct Chat::Wire::Header
+     * @brief The header of every Chat::Message, as it's laid out on the wire
+     * @author Noak Palander
+     *
+     * The length and type are in the same place as in every other frame. Every field is naturally aligned,
+     * so there is no padding and the struct is copied to and from the wire as a whole.
+     */
+    struct Header {
+        std::uint32_t length;       /**< The length of the remainder of the packet, used for framing */
+        MessageType type;
+        std::uint8_t version;       /**< Wire::Version */
+        std::uint8_t flags;         /**< Reserved for optional features, sent as 0 and ignored when unknown */
+        std::uint8_t room;          /**< The length of the room name that follows the header */
+        std::uint64_t sequence;     /**< Increases by one for every message constructed by the sender */
+        std::int64_t timestamp;     /**< Nanoseconds since the epoch of the sender's system clock */
+        std::uint64_t id;           /**< The hash of the message, acknowledgements carry the hash they acknowledge */
+    };
+
+    /**
+     * @brief Every field of the header in order, the byte order of each one is converted separately
+     */
+    inline constexpr auto HeaderFields = std::make_tuple(&Header::length, &Header::type, &Header::version, &Header::flags,
+                                                         &Header::room, &Header::sequence, &Header::timestamp, &Header::id);
+
+    static_assert(std::is_trivially_copyable_v<Header> && std::is_standard_layout_v<Header>);
+    static_assert(sizeof(MessageType) == 1);
+    static_assert(offsetof(Header, length) == 0 && offsetof(Header, type) == 4 && offsetof(Header, version) == 5 &&
+                  offsetof(Header, flags) == 6 && offsetof(Header, room) == 7 && offsetof(Header, sequence) == 8 &&
+                  offsetof(Header, timestamp) == 16 && offsetof(Header, id) == 24);
+    static_assert(sizeof(Header) == 32, "The header must not be padded");
+    static_assert(std::apply([](auto... fields) { return (sizeof(Header{}.*fields) + ...); }, HeaderFields) == sizeof(Header),
+                  "Every field of the header must be listed in HeaderFields");
+
+    /**
+     * @brief Converts every field of the header between the host and the wire byte order
+     */
+    [[nodiscard]] constexpr Header Little(Header header) noexcept {
+        if constexpr (std::endian::native != std::endian::little)
+            std::apply([&header](auto... fields) { ((header.*fields = ByteSwap(header.*fields)), ...); }, HeaderFields);
+
+        return header;
+    }
+
+    /**
+     * @brief Reads the header from the start of a packet, which must hold at least sizeof(Header) bytes
+     */
+    [[nodiscard]] inline Header LoadHeader(std::byte const* ptr) noexcept {
+        Header header;
+        std::memcpy(&header, ptr, sizeof(Header));
+        return Little(header);
+    }
+
+    /**
+     * @brief Writes the header to the start of a packet
+     */
+    inline void StoreHeader(std::byte* ptr, Header const& header) noexcept {
+        Header const wire = Little(header);
+        std::memcpy(ptr, &wire, sizeof(Header));
+    }
+}
+
+#endif // CHATAPP_WIRE_HPP
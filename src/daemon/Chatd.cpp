@@ -0,0 +1,359 @@
+/**
+ * @file Chatd.cpp
+ * @brief The headless server, it hosts a Chat::Processor without Qt
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * Usage: chatd [--config FILE] [--port P] [--peer HOST:PORT]... [--link-from ADDRESS]... [--downloads DIR] [--download-quota BYTES]
+ *              [--capture FILE] [--stats-interval MS] [--dedup-window N] [--no-forward] [--drain-timeout MS] [--trace LEVEL] [--trace-file FILE]
+ *              [--heartbeat MS] [--heartbeat-timeout MS] [--write-timeout MS] [--rate-messages N] [--rate-bytes N] [--rate-burst MS]
+ *              [--throttle delay|drop|disconnect] [--accept-rate N] [--accept-burst N]
+ *              [--max-connections N] [--max-rooms N] [--max-joins N]
+ *
+ * A config file holds one "key = value" per line, with the same keys as the options without the dashes,
+ * "#" starts a comment, "peer" and "link-from" may be repeated and "forward = false" replaces --no-forward.
+ * The file is applied first, so the command line overrides it, and adds to its peers.
+ * Only the peers and the --link-from addresses may link to the server, a link isn't rate limited.
+ * Relayed files are only stored when --downloads is given, up to the download quota.
+ *
+ * SIGINT and SIGTERM drain the server: it stops accepting connections, waits until every queued message
+ * has been sent or the drain timeout passes, then shuts down. A second signal shuts down right away.
+ * SIGHUP prints a snapshot of the connections, rooms and links.
+ */
+
+#include "../core/Processor.hpp"
+#include "../core/Trace.hpp"
+#include "fmt/format.h"
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace {
+    struct Configuration {
+        int port = 9000;
+        Chat::Processor::Options options;
+        std::chrono::milliseconds drainTimeout{5000};
+        std::optional<Trace::Level> trace;
+        std::string traceFile;
+    };
+
+    std::string_view Trim(std::string_view text) {
+        auto const first = text.find_first_not_of(" \t\r");
+        if (first == std::string_view::npos)
+            return {};
+
+        auto const last = text.find_last_not_of(" \t\r");
+        return text.substr(first, last - first + 1);
+    }
+
+    /**
+     * @brief Parses a whole decimal number
+     * @return nothing if the text isn't one, or is out of range
+     */
+    std::optional<long long> Number(std::string_view text, long long min, long long max) {
+        std::string const copy(text);
+        char* end = nullptr;
+        errno = 0;
+        long long const value = std::strtoll(copy.c_str(), &end, 10);
+
+        if (copy.empty() || *end != '\0' || errno != 0 || value < min || value > max)
+            return std::nullopt;
+
+        return value;
+    }
+
+    /**
+     * @brief Applies a single setting, from either the config file or the command line
+     * @param key the name of the setting, without dashes
+     * @param value its value, empty for flags
+     * @return an error message, or nothing if the setting was applied
+     */
+    std::optional<std::string> Apply(Configuration& configuration, std::string_view key, std::string_view value) {
+        auto& options = configuration.options;
+
+        if (key == "port") {
+            auto const port = Number(value, 1, 65535);
+            if (!port)
+                return fmt::format("invalid port '{}'", value);
+            configuration.port = static_cast<int>(*port);
+        }
+        else if (key == "peer") {
+            auto const colon = value.rfind(':');
+            auto const port = colon == std::string_view::npos ? std::nullopt : Number(value.substr(colon + 1), 1, 65535);
+            if (!port || colon == 0)
+                return fmt::format("invalid peer '{}', expected HOST:PORT", value);
+            options.peers.push_back({ std::string(value.substr(0, colon)), static_cast<int>(*port) });
+        }
+        else if (key == "link-from") {
+            asio::error_code ec;
+            asio::ip::make_address(std::string(value), ec);
+            if (ec)
+                return fmt::format("invalid link-from '{}', expected an IP address", value);
+            options.linkFrom.emplace_back(value);
+        }
+        else if (key == "downloads") {
+            options.downloads = std::string(value);
+        }
+        else if (key == "download-quota") {
+            auto const quota = Number(value, 0, 1LL << 50);
+            if (!quota)
+                return fmt::format("invalid download quota '{}'", value);
+            options.downloadQuota = static_cast<std::uint64_t>(*quota);
+        }
+        else if (key == "capture") {
+            options.capture = std::string(value);
+        }
+        else if (key == "stats-interval") {
+            auto const interval = Number(value, 1, 86'400'000);
+            if (!interval)
+                return fmt::format("invalid stats interval '{}'", value);
+            options.statsInterval = std::chrono::milliseconds(*interval);
+        }
+        else if (key == "dedup-window") {
+            auto const window = Number(value, 0, 1 << 24);
+            if (!window)
+                return fmt::format("invalid dedup window '{}'", value);
+            options.dedupWindow = static_cast<std::size_t>(*window);
+        }
+        else if (key == "forward") {
+            if (value != "true" && value != "false")
+                return fmt::format("invalid forward '{}', expected true or false", value);
+            options.forward = value == "true";
+        }
+        else if (key == "no-forward") {
+            options.forward = false;
+        }
+        else if (key == "heartbeat") {
+            auto const interval = Number(value, 0, 3'600'000);
+            if (!interval)
+                return fmt::format("invalid heartbeat interval '{}'", value);
+            options.liveness.interval = std::chrono::milliseconds(*interval);
+        }
+        else if (key == "heartbeat-timeout") {
+            auto const timeout = Number(value, 1, 3'600'000);
+            if (!timeout)
+                return fmt::format("invalid heartbeat timeout '{}'", value);
+            options.liveness.timeout = std::chrono::milliseconds(*timeout);
+        }
+        else if (key == "write-timeout") {
+            auto const timeout = Number(value, 0, 3'600'000);
+            if (!timeout)
+                return fmt::format("invalid write timeout '{}'", value);
+            options.liveness.writeTimeout = std::chrono::milliseconds(*timeout);
+        }
+        else if (key == "rate-messages" || key == "rate-bytes" || key == "accept-rate") {
+            auto const rate = Number(value, 0, 1LL << 40);
+            if (!rate)
+                return fmt::format("invalid {} '{}'", key, value);
+
+            if (key == "rate-messages")
+                options.limits.messagesPerSecond = static_cast<double>(*rate);
+            else if (key == "rate-bytes")
+                options.limits.bytesPerSecond = static_cast<double>(*rate);
+            else
+                options.admission.acceptsPerSecond = static_cast<double>(*rate);
+        }
+        else if (key == "rate-burst") {
+            auto const burst = Number(value, 1, 3'600'000);
+            if (!burst)
+                return fmt::format("invalid rate burst '{}'", value);
+            options.limits.burst = std::chrono::milliseconds(*burst);
+        }
+        else if (key == "throttle") {
+            if (value == "delay")
+                options.limits.action = Chat::Throttle::Delay;
+            else if (value == "drop")
+                options.limits.action = Chat::Throttle::Drop;
+            else if (value == "disconnect")
+                options.limits.action = Chat::Throttle::Disconnect;
+            else
+                return fmt::format("invalid throttle '{}', expected delay, drop or disconnect", value);
+        }
+        else if (key == "accept-burst") {
+            auto const burst = Number(value, 1, 1 << 24);
+            if (!burst)
+                return fmt::format("invalid accept burst '{}'", value);
+            options.admission.acceptBurst = static_cast<std::size_t>(*burst);
+        }
+        else if (key == "max-connections") {
+            auto const connections = Number(value, 0, 1 << 24);
+            if (!connections)
+                return fmt::format("invalid max connections '{}'", value);
+            options.admission.maxConnections = static_cast<std::size_t>(*connections);
+        }
+        else if (key == "max-rooms" || key == "max-joins") {
+            auto const rooms = Number(value, 0, 1 << 24);
+            if (!rooms)
+                return fmt::format("invalid {} '{}'", key, value);
+
+            if (key == "max-rooms")
+                options.maxRooms = static_cast<std::size_t>(*rooms);
+            else
+                options.maxJoins = static_cast<std::size_t>(*rooms);
+        }
+        else if (key == "drain-timeout") {
+            auto const timeout = Number(value, 0, 3'600'000);
+            if (!timeout)
+                return fmt::format("invalid drain timeout '{}'", value);
+            configuration.drainTimeout = std::chrono::milliseconds(*timeout);
+        }
+        else if (key == "trace") {
+            configuration.trace = Trace::ParseLevel(value, Trace::GetLevel());
+        }
+        else if (key == "trace-file") {
+            configuration.traceFile = std::string(value);
+        }
+        else {
+            return fmt::format("unknown setting '{}'", key);
+        }
+
+        return std::nullopt;
+    }
+
+    std::optional<std::string> Load(Configuration& configuration, std::string const& path) {
+        std::ifstream file(path);
+        if (!file)
+            return fmt::format("can't open {}", path);
+
+        std::string line;
+        for (int number = 1; std::getline(file, line); ++number) {
+            std::string_view content = line;
+            content = Trim(content.substr(0, content.find('#')));
+            if (content.empty())
+                continue;
+
+            auto const equals = content.find('=');
+            if (equals == std::string_view::npos)
+                return fmt::format("{}:{}: expected 'key = value'", path, number);
+
+            if (auto error = Apply(configuration, Trim(content.substr(0, equals)), Trim(content.substr(equals + 1))))
+                return fmt::format("{}:{}: {}", path, number, *error);
+        }
+
+        return std::nullopt;
+    }
+
+    void Report(Chat::Processor const& processor) {
+        auto const stats = processor.Stats();
+        fmt::print("{} sessions, {} queued bytes, {} duplicates dropped\n", stats.sessions.size(), stats.queuedBytes, stats.duplicates);
+        fmt::print("Receive buffers of {} bytes: {} in use, {} cached, peak {}, {} allocated, {} reused\n", stats.receive.slabSize,
+                   stats.receive.inUse, stats.receive.cached, stats.receive.peak, stats.receive.allocated, stats.receive.reused);
+        fmt::print("Throttled: {} reads delayed, {} frames dropped, {} disconnected, {} connections rejected, {} accept pauses\n",
+                   stats.throttle.delayed, stats.throttle.dropped, stats.throttle.disconnected, stats.throttle.rejected,
+                   stats.throttle.acceptsDelayed);
+
+        for (auto const& room : stats.rooms)
+            fmt::print("Room {} has {} members, {:.1f} messages/s\n", room.name, room.members, room.messagesPerSecond);
+
+        for (auto const& link : stats.links) {
+            fmt::print("Link to {:016x}: relayed {} in {} batches, {} dropped, received {}, suppressed {}\n",
+                       link.node, link.relayed, link.batches, link.dropped, link.received, link.suppressed);
+        }
+
+        std::fflush(stdout);
+    }
+}
+
+int main(int argc, char** argv) {
+    auto const started = std::chrono::steady_clock::now();
+    Configuration configuration;
+
+    // The config file is applied first, wherever it is on the command line
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string_view(argv[i]) != "--config")
+            continue;
+
+        if (auto error = Load(configuration, argv[i + 1])) {
+            fmt::print(stderr, "chatd: {}\n", *error);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument = argv[i];
+        bool const flag = argument == "--no-forward";
+
+        if (!argument.starts_with("--") || (!flag && i + 1 >= argc)) {
+            fmt::print(stderr, "Usage: {} [--config FILE] [--port P] [--peer HOST:PORT]... [--link-from ADDRESS]... [--downloads DIR] [--download-quota BYTES]\n"
+                               "       [--capture FILE] [--stats-interval MS] [--dedup-window N] [--no-forward] [--drain-timeout MS] "
+                               "[--trace LEVEL] [--trace-file FILE]\n"
+                               "       [--heartbeat MS] [--heartbeat-timeout MS] [--write-timeout MS] [--rate-messages N] [--rate-bytes N] [--rate-burst MS]\n"
+                               "       [--throttle delay|drop|disconnect] [--accept-rate N] [--accept-burst N]\n"
+                               "       [--max-connections N] [--max-rooms N] [--max-joins N]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        argument.remove_prefix(2);
+        std::string_view const value = flag ? std::string_view() : argv[++i];
+        if (argument == "config")
+            continue;
+
+        if (auto error = Apply(configuration, argument, value)) {
+            fmt::print(stderr, "chatd: {}\n", *error);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (configuration.trace)
+        Trace::SetLevel(*configuration.trace);
+
+    if (!configuration.traceFile.empty() && !Trace::Open(configuration.traceFile)) {
+        fmt::print(stderr, "chatd: can't open the trace file {}\n", configuration.traceFile);
+        return EXIT_FAILURE;
+    }
+
+    // The signals are blocked before the io thread starts, so that it inherits the mask and only sigwait sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::optional<Chat::Processor> processor;
+    try {
+        processor.emplace(configuration.port, [](Chat::Message const&) {}, []{}, []{}, std::move(configuration.options));
+    }
+    catch (std::exception const& e) {
+        fmt::print(stderr, "chatd: can't listen on port {}: {}\n", configuration.port, e.what());
+        return EXIT_FAILURE;
+    }
+
+    fmt::print("chatd listening on port {}, started in {:.2f} ms\n", configuration.port,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+    std::fflush(stdout);
+
+    int signal = 0;
+    while (sigwait(&signals, &signal) == 0 && signal == SIGHUP)
+        Report(*processor);
+
+    // Drains until every queue is empty, the timeout passes, or another signal arrives
+    processor->Drain();
+    fmt::print("chatd draining, signal {} again to stop right away\n", signal);
+    std::fflush(stdout);
+
+    auto const deadline = std::chrono::steady_clock::now() + configuration.drainTimeout;
+    timespec const poll{ .tv_sec = 0, .tv_nsec = 10'000'000 };
+
+    while (processor->Stats().queuedBytes > 0 && std::chrono::steady_clock::now() < deadline) {
+        int const received = sigtimedwait(&signals, nullptr, &poll);
+        if (received == SIGINT || received == SIGTERM)
+            break;
+        if (received == SIGHUP)
+            Report(*processor);
+    }
+
+    auto const queued = processor->Stats().queuedBytes;
+    processor.reset();
+    Trace::Flush();
+
+    fmt::print("chatd stopped{}\n", queued > 0 ? fmt::format(", dropped {} queued bytes", queued) : "");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+/**
+ * @file Mesh.cpp
+ * @brief A headless tool that runs several federated servers on loopback, and measures the throughput of the mesh
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * Usage: ChatMesh [--nodes N] [--clients C] [--messages M] [--port P] [--ring]
+ *
+ * Starts N servers on consecutive ports, linked as a full mesh or with --ring as a ring, and C clients on every server.
+ * Servers in a full mesh receive every message straight from its origin, so only a ring forwards relayed messages,
+ * in which case most messages reach a server through two links and the second copy is suppressed.
+ * Every client publishes M messages to the lobby, and every other client must receive all of them, in the order
+ * they were sent by their sender. The tool reports the aggregate delivery rate and any ordering violations.
+ */
+
+#include "../core/Processor.hpp"
+#include "fmt/format.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+    struct Arguments {
+        std::size_t nodes = 3;
+        std::size_t clients = 4;
+        std::size_t messages = 10000;
+        int port = 9500;
+        bool ring = false;
+    };
+
+    /**
+     * @struct Receiver
+     * @brief The deliveries seen by a single client, only modified on the client's io thread
+     */
+    struct Receiver {
+        std::atomic<std::size_t> received{0};
+        std::atomic<std::size_t> reordered{0};
+        std::vector<std::int64_t> last;     /**< The last sequence received from every sender */
+    };
+
+    /**
+     * @brief Polls until a condition holds or a deadline passes
+     * @return true if the condition holds
+     */
+    template<typename Condition>
+    bool Await(Condition condition, std::chrono::seconds timeout) {
+        auto const deadline = std::chrono::steady_clock::now() + timeout;
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    Arguments arguments;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view const argument = argv[i];
+        bool const valued = i + 1 < argc;
+
+        if (argument == "--nodes" && valued)
+            arguments.nodes = std::max(1, std::atoi(argv[++i]));
+        else if (argument == "--clients" && valued)
+            arguments.clients = std::max(1, std::atoi(argv[++i]));
+        else if (argument == "--messages" && valued)
+            arguments.messages = std::max(1, std::atoi(argv[++i]));
+        else if (argument == "--port" && valued)
+            arguments.port = std::atoi(argv[++i]);
+        else if (argument == "--ring")
+            arguments.ring = true;
+        else {
+            fmt::print(stderr, "Usage: {} [--nodes N] [--clients C] [--messages M] [--port P] [--ring]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::size_t const total = arguments.nodes * arguments.clients;
+
+    // The servers, every server links to the ones started before it, or only to its predecessor in a ring
+    std::vector<std::unique_ptr<Chat::Processor>> servers;
+    std::size_t expectedLinks = 0;
+
+    for (std::size_t node = 0; node < arguments.nodes; ++node) {
+        Chat::Processor::Options options;
+        options.forward = arguments.ring;
+        options.linkFrom.push_back("127.0.0.1");
+
+        // The first server of a ring links to the last one, which isn't listening yet, so it's retried until it is
+        if (arguments.ring) {
+            if (node > 0)
+                options.peers.push_back({ "127.0.0.1", arguments.port + static_cast<int>(node) - 1 });
+            else if (arguments.nodes > 2)
+                options.peers.push_back({ "127.0.0.1", arguments.port + static_cast<int>(arguments.nodes) - 1 });
+        }
+        else {
+            for (std::size_t peer = 0; peer < node; ++peer)
+                options.peers.push_back({ "127.0.0.1", arguments.port + static_cast<int>(peer) });
+        }
+
+        expectedLinks += options.peers.size() * 2;
+        servers.push_back(std::make_unique<Chat::Processor>(arguments.port + static_cast<int>(node),
+                                                            [](Chat::Message const&) {}, []{}, []{}, std::move(options)));
+    }
+
+    // Every link has exchanged hellos in both directions
+    auto const linked = [&] {
+        std::size_t links = 0;
+        for (auto const& server : servers) {
+            auto const stats = server->Stats();
+            links += static_cast<std::size_t>(std::count_if(stats.links.begin(), stats.links.end(), [](auto const& link) {
+                return link.node != 0;
+            }));
+        }
+        return links >= expectedLinks;
+    };
+
+    if (!Await(linked, std::chrono::seconds(10))) {
+        fmt::print(stderr, "The servers failed to link\n");
+        return EXIT_FAILURE;
+    }
+
+    // The clients, spread evenly over the servers
+    std::vector<std::unique_ptr<Receiver>> receivers;
+    std::vector<std::unique_ptr<Chat::Processor>> clients;
+    std::atomic<std::size_t> connected{0};
+
+    for (std::size_t client = 0; client < total; ++client) {
+        auto& receiver = *receivers.emplace_back(std::make_unique<Receiver>());
+        receiver.last.assign(total, -1);
+
+        auto const onReceive = [&receiver](Chat::Message const& message) {
+            if (message.Type() != Chat::MessageType::New)
+                return;
+
+            // Every message is "<sender> <sequence>"
+            std::size_t sender = 0;
+            std::int64_t sequence = 0;
+            if (std::sscanf(message.Contents().c_str(), "%zu %ld", &sender, &sequence) != 2 || sender >= receiver.last.size())
+                return;
+
+            if (sequence <= receiver.last[sender])
+                receiver.reordered.fetch_add(1, std::memory_order_relaxed);
+
+            receiver.last[sender] = sequence;
+            receiver.received.fetch_add(1, std::memory_order_relaxed);
+        };
+
+        clients.push_back(std::make_unique<Chat::Processor>(arguments.port + static_cast<int>(client % arguments.nodes), "127.0.0.1",
+                                                            onReceive, [&connected]{ ++connected; }, []{}));
+    }
+
+    if (!Await([&] { return connected == total; }, std::chrono::seconds(10))) {
+        fmt::print(stderr, "The clients failed to connect\n");
+        return EXIT_FAILURE;
+    }
+
+    // Every client publishes from its own thread
+    std::size_t const expected = total * (total - 1) * arguments.messages;
+    auto const start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> producers;
+        for (std::size_t client = 0; client < total; ++client) {
+            producers.emplace_back([&, client] {
+                for (std::size_t sequence = 0; sequence < arguments.messages; ++sequence)
+                    clients[client]->Transmit(Chat::Message::From(fmt::format("{} {}", client, sequence)));
+            });
+        }
+    }
+
+    auto const delivered = [&] {
+        std::size_t sum = 0;
+        for (auto const& receiver : receivers)
+            sum += receiver->received.load(std::memory_order_relaxed);
+        return sum;
+    };
+
+    bool const complete = Await([&] { return delivered() >= expected; }, std::chrono::seconds(60));
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::size_t reordered = 0;
+    for (auto const& receiver : receivers)
+        reordered += receiver->reordered.load(std::memory_order_relaxed);
+
+    fmt::print("{} nodes{}, {} clients, {} messages each\n", arguments.nodes, arguments.ring ? " in a ring" : "", total, arguments.messages);
+    fmt::print("Delivered {} of {} in {:.3f} s, {:.0f} deliveries/s, {} out of order\n",
+               delivered(), expected, seconds, static_cast<double>(delivered()) / seconds, reordered);
+
+    for (std::size_t node = 0; node < servers.size(); ++node) {
+        for (auto const& link : servers[node]->Stats().links) {
+            fmt::print("Node {} link to {:016x}: relayed {} in {} batches, {} dropped, received {}, suppressed {}\n", node, link.node,
+                       link.relayed, link.batches, link.dropped, link.received, link.suppressed);
+        }
+    }
+
+    return complete && reordered == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
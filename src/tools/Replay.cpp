@@ -0,0 +1,165 @@
+/**
+ * @file Replay.cpp
+ * @brief A headless tool that feeds a capture through the receive path, without any sockets
+ * @author Noak Palander
+ * @version 1.0
+ *
+ * Usage: ChatReplay <capture> [--client] [--paced] [--repeat N]
+ *
+ * Every received frame is first only decoded, then fed through Processor::Replay, which runs the same
+ * Deserialize -> dispatch -> acknowledge path as a live connection. Sent frames are skipped.
+ * By default the frames are replayed as fast as possible, --paced keeps the original timing instead.
+ */
+
+#include "../core/Capture.hpp"
+#include "../core/Clock.hpp"
+#include "../core/Processor.hpp"
+#include "../core/Transfer.hpp"
+#include "fmt/format.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+    struct Arguments {
+        std::filesystem::path capture;
+        Chat::Mode mode = Chat::Mode::Server;
+        bool paced = false;
+        int repeat = 1;
+    };
+
+    /**
+     * @brief Prints the throughput of a replayed stage
+     */
+    void Report(std::string_view stage, std::size_t frames, std::size_t bytes, std::chrono::nanoseconds elapsed) {
+        double const seconds = std::chrono::duration<double>(elapsed).count();
+        fmt::print("{:<10} {:>10} frames {:>14} bytes {:>10.3f} ms {:>12.0f} frames/s {:>10.1f} MiB/s {:>8.1f} ns/frame\n",
+                   stage, frames, bytes, seconds * 1e3,
+                   seconds > 0.0 ? static_cast<double>(frames) / seconds : 0.0,
+                   seconds > 0.0 ? static_cast<double>(bytes) / seconds / (1024.0 * 1024.0) : 0.0,
+                   frames > 0 ? static_cast<double>(elapsed.count()) / static_cast<double>(frames) : 0.0);
+    }
+
+    /**
+     * @brief Only decodes a frame, the result is folded into a checksum so the work isn't optimized away
+     */
+    std::uint64_t Decode(std::vector<std::byte> const& packet) {
+        auto const type = static_cast<Chat::MessageType>(packet[sizeof(std::uint32_t)]);
+
+        if (type == Chat::MessageType::Offer) {
+            auto const offer = Chat::DecodeOffer(packet);
+            return offer ? offer->id : 0;
+        }
+
+        if (type == Chat::MessageType::Chunk) {
+            auto const chunk = Chat::DecodeChunk(packet);
+            return chunk ? chunk->offset + chunk->payload.size() : 0;
+        }
+
+        if (type == Chat::MessageType::ClockProbe || type == Chat::MessageType::ClockReply) {
+            auto const sample = Chat::DecodeClockReply(packet, std::chrono::system_clock::time_point());
+            return sample ? static_cast<std::uint64_t>(sample->sent.time_since_epoch().count()) : packet.size();
+        }
+
+        auto const message = Chat::Message::Deserialize(packet);
+        return message ? message->Identifier() ^ message->Contents().size() : 0;
+    }
+}
+
+int main(int argc, char** argv) {
+    Arguments arguments;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view const argument = argv[i];
+
+        if (argument == "--client")
+            arguments.mode = Chat::Mode::Client;
+        else if (argument == "--paced")
+            arguments.paced = true;
+        else if (argument == "--repeat" && i + 1 < argc)
+            arguments.repeat = std::max(1, std::atoi(argv[++i]));
+        else if (arguments.capture.empty() && !argument.starts_with("--"))
+            arguments.capture = argument;
+        else {
+            fmt::print(stderr, "Unknown argument {}\n", argument);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (arguments.capture.empty()) {
+        fmt::print(stderr, "Usage: {} <capture> [--client] [--paced] [--repeat N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The frames are loaded up front, so reading the file isn't part of the measurements
+    std::vector<Chat::CapturedFrame> frames;
+    std::size_t bytes = 0;
+    std::size_t skipped = 0;
+
+    try {
+        Chat::CaptureReader reader(arguments.capture);
+        Chat::CapturedFrame frame;
+
+        while (reader.Next(frame)) {
+            if (frame.direction != Chat::Direction::Received) {
+                ++skipped;
+                continue;
+            }
+
+            bytes += frame.packet.size();
+            frames.push_back(frame);
+        }
+
+        fmt::print("Loaded {} received frames, {} bytes, skipped {} sent frames\n", frames.size(), bytes, skipped);
+    }
+    catch (std::exception const& e) {
+        fmt::print(stderr, "Failed to read the capture, reason being: {}\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    std::size_t total = frames.size() * static_cast<std::size_t>(arguments.repeat);
+    std::size_t totalBytes = bytes * static_cast<std::size_t>(arguments.repeat);
+
+    // The decode stage on its own
+    std::uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int pass = 0; pass < arguments.repeat; ++pass) {
+        for (auto const& frame : frames)
+            checksum += Decode(frame.packet);
+    }
+
+    Report("decode", total, totalBytes, std::chrono::steady_clock::now() - start);
+
+    // The full receive path, received files are written to a scratch directory
+    std::size_t delivered = 0;
+    Chat::Processor::Options options;
+    options.downloads = std::filesystem::temp_directory_path() / "ChatReplay";
+
+    std::chrono::nanoseconds elapsed{0};
+
+    for (int pass = 0; pass < arguments.repeat; ++pass) {
+        // Every pass gets a fresh processor, a second pass through the same one would only measure the duplicate filter and
+        // the relay's suppression of sequences it has already delivered, constructing it isn't measured
+        Chat::Processor processor(arguments.mode, [&delivered](Chat::Message const&) { ++delivered; }, options);
+        auto const passStart = std::chrono::steady_clock::now();
+
+        for (auto const& frame : frames) {
+            // Pacing is relative to the first frame, the idle time before it isn't replayed
+            if (arguments.paced)
+                std::this_thread::sleep_until(passStart + (frame.elapsed - frames.front().elapsed));
+
+            processor.Replay(frame.session, frame.packet);
+        }
+
+        elapsed += std::chrono::steady_clock::now() - passStart;
+    }
+
+    Report("pipeline", total, totalBytes, elapsed);
+    fmt::print("Delivered {} messages, checksum {:016x}\n", delivered, checksum);
+    return EXIT_SUCCESS;
+}
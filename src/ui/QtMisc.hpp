@@ -0,0 +1,40 @@
+/**
+ * @file QtMisc.hpp
+ * @brief Contains the helpers of the UI that produce Qt types
+ * @author Noak Palander
+ * @version 1.0
+ */
+
+#ifndef CHATAPP_QTMISC_HPP
+#define CHATAPP_QTMISC_HPP
+
+#include <QString>
+#include <string_view>
+#include "../core/Misc.hpp"
+
+namespace Misc {
+    /**
+     * @brief Converts UTF-8 to a QString, text known to be ASCII skips the UTF-8 decoder
+     * @param text the text, it must be valid UTF-8
+     * @param ascii whether every byte is below 0x80, see Chat::TextKind
+     * @return the text as a QString
+     */
+    [[nodiscard]] inline QString QText(std::string_view text, bool ascii) {
+        auto const size = static_cast<int>(text.size());
+        return ascii ? QString::fromLatin1(text.data(), size) : QString::fromUtf8(text.data(), size);
+    }
+
+    /**
+     * @brief Provides an fmt::format version that produces a QString instead of an std::string
+     * @param format the format string, follows fmtlib formatting
+     * @param args the args that should be formatted into the string
+     * @return the formatted output as a QString
+     */
+    template<typename... Args>
+    [[nodiscard]] inline QString QFormat(std::string_view format, Args&&... args) {
+        return QString::fromStdString(Format(format, std::forward<Args>(args)...));
+    }
+}
+
+
+#endif //CHATAPP_QTMISC_HPP
@@ -10,9 +10,12 @@
 #include "./ui_AppWidget.h"
 #include <QMessageBox>
 #include <QLineEdit>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
 #include <memory>
-#include "../../core/Misc.hpp"
+#include "../QtMisc.hpp"
+#include "../../core/Trace.hpp"
 
 
 AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
@@ -32,6 +35,9 @@ AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
     if (mode_ == Chat::Mode::Server)
         ui_->addrEdit->setDisabled(true);
 
+    // Large pastes are sent as transfers rather than being cut off
+    ui_->lineEdit->setMaxLength(std::numeric_limits<int>::max());
+
     // If the start/connect button was pressed
     connect(ui_->startBtn, &QPushButton::pressed, this, [this]{
         switch(mode_) {
@@ -42,7 +48,8 @@ AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
                     processor_ = std::make_unique<Chat::Processor>(ui_->portEdit->text().toInt(),
                                                                    std::bind_front(&AppWidget::Received, this),
                                                                    std::bind_front(&AppWidget::Connected, this),
-                                                                   std::bind_front(&AppWidget::Disconnected, this));
+                                                                   std::bind_front(&AppWidget::Disconnected, this),
+                                                                   Options());
                     ui_->startBtn->setDisabled(true);
                 }
                 catch(asio::system_error& e) {
@@ -59,7 +66,8 @@ AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
                                                                    ui_->addrEdit->text().toStdString(),
                                                                    std::bind_front(&AppWidget::Received, this),
                                                                    std::bind_front(&AppWidget::Connected, this),
-                                                                   std::bind_front(&AppWidget::Disconnected, this));
+                                                                   std::bind_front(&AppWidget::Disconnected, this),
+                                                                   Options());
                 }
                 catch(asio::system_error& e) {
                     QMessageBox::critical(this, "Failed to connect to the server!",
@@ -73,13 +81,61 @@ AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
     connect(ui_->lineEdit, &QLineEdit::returnPressed, this, [this]{
         QString const text = ui_->lineEdit->text();
 
-        if (!text.isEmpty()) {
+        // Room subscriptions are written as commands, '/join <room>' and '/leave <room>'
+        if (text.startsWith("/join ") || text.startsWith("/leave ")) {
+            bool const join = text.startsWith("/join ");
+            std::string const room = text.section(' ', 1).trimmed().toStdString();
+            ui_->lineEdit->clear();
+
+            if (room.empty())
+                return;
+
+            processor_->Transmit(join ? Chat::Message::Join(room) : Chat::Message::Leave(room));
+
+            // A join only takes effect once the server confirms it, leaving takes effect right away
+            if (join) {
+                emit Log(Misc::QFormat("Joining #{}\n", room));
+                return;
+            }
+
+            if (room_ == room)
+                room_ = Chat::DefaultRoom;
+
+            emit Log(Misc::QFormat("Left #{}, now publishing to #{}\n", room, room_));
+            return;
+        }
+
+        // Files are sent with '/send <path>'
+        if (text.startsWith("/send ")) {
+            std::string const path = text.section(' ', 1).trimmed().toStdString();
+            ui_->lineEdit->clear();
+
+            try {
+                processor_->SendFile(path, room_);
+            }
+            catch(std::system_error& e) {
+                emit Log(Misc::QFormat("Failed to send {}, reason being: {}\n", path, e.what()));
+            }
+            return;
+        }
+
+        // Pastes too large for a single message are chunked, so they don't hold up the rest of the chat, the chunk size is in
+        // bytes so it's compared to the UTF-8 encoding rather than the UTF-16 code units of the QString
+        std::string utf8 = text.toStdString();
+        if (utf8.size() > Chat::OutgoingTransfer::ChunkSize) {
+            ui_->lineEdit->clear();
+            processor_->SendText(std::move(utf8), room_);
+            return;
+        }
+
+        if (!utf8.empty()) {
             // Constructs a new message given the written text
-            auto const message = Chat::Message::From(text.toStdString());
+            auto const message = Chat::Message::From(utf8, room_);
 
             // The item that will be displayed on the local chat box
             auto listItem = new QListWidgetItem(ui_->chatBox);
-            listItem->setText(Misc::QFormat("[You]: {}", message.Contents()));
+            listItem->setText(Misc::QText(fmt::format("[You] #{}: {}", message.Room(), message.Contents()),
+                                          message.Text() == Chat::TextKind::Ascii));
             ui_->lineEdit->clear();
 
             // Stores the message's hash to the timestamp and item, so we can go back using the ID to update the text to also
@@ -87,7 +143,7 @@ AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
             data_.emplace(message.Identifier(), std::pair{ message.Timestamp(), listItem });
 
             // Transmit message
-            Misc::Debug("[{}]: Sent a message with ID {}!\n", mode_, message.Identifier());
+            Trace::Emit(Trace::Event::MessageSent, message.Identifier());
             processor_->Transmit(message);
         }
     });
@@ -107,6 +163,35 @@ AppWidget::AppWidget(Chat::Mode mode, QWidget* parent)
     connect(this, &AppWidget::NoHost, this, [this]{
         processor_.reset(nullptr);
     });
+
+    // Updates the progress of a transfer, the item is created by the first report
+    connect(this, &AppWidget::Progress, this, [this](quint64 id, QString const& text) {
+        auto [iter, created] = transfers_.try_emplace(id, nullptr);
+        if (created)
+            iter->second = new QListWidgetItem(ui_->chatBox);
+
+        iter->second->setText(text);
+    });
+
+    // New messages are published to the most recently joined room, the server answers a refused join, or a message published
+    // to a room we aren't a member of, with a leave
+    connect(this, &AppWidget::Subscribed, this, [this](QString const& name, bool joined) {
+        std::string const room = name.toStdString();
+
+        if (joined)
+            room_ = room;
+        else if (room_ == room)
+            room_ = Chat::DefaultRoom;
+
+        emit Log(Misc::QFormat("{} #{}, now publishing to #{}\n", joined ? "Joined" : "Not a member of", room, room_));
+    });
+
+    // Stops producing messages while the peer can't keep up
+    connect(this, &AppWidget::Backpressure, this, [this](bool paused) {
+        ui_->lineEdit->setDisabled(paused);
+        ui_->console->insertPlainText(paused ? "The connection is congested, sending is paused\n"
+                                             : "The connection drained, sending is resumed\n");
+    });
 }
 
 
@@ -120,20 +205,28 @@ AppWidget::~AppWidget() {
 void AppWidget::Received(Chat::Message const& message) {
     // Received a new message
     if (message.Type() == Chat::MessageType::New) {
-        emit Append(Misc::QFormat("[{}]: {}", !mode_, message.Contents()));
+        Trace::Emit(Trace::Event::MessageReceived, message.Identifier());
+        emit Append(Misc::QText(fmt::format("[{}] #{}: {}", !mode_, message.Room(), message.Contents()),
+                                message.Text() == Chat::TextKind::Ascii));
+    }
+    // The server's answer to a join, room_ is only touched on the UI thread
+    else if (message.Type() == Chat::MessageType::Join || message.Type() == Chat::MessageType::Leave) {
+        emit Subscribed(QString::fromStdString(message.Room()), message.Type() == Chat::MessageType::Join);
     }
     else {
-        Misc::Debug("[{}]: Received a message with ID {}!\n", mode_, message.Identifier());
+        Trace::Emit(Trace::Event::AckReceived, message.Identifier());
         // Finds the related message that was recently acknowledged
         if (auto iter = data_.find(message.Identifier()); iter != data_.end()) {
             auto[time, widget] = iter->second;
 
-            // Calculate the response time
-            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(message.Timestamp() - time);
+            // The processor stamps acknowledgements in our clock once it knows the peer's, so each direction can be told apart
+            auto const roundTrip = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - time);
+            auto const delivered = std::chrono::duration_cast<std::chrono::microseconds>(message.Timestamp() - time);
 
             // Updates the text
-            widget->setText(Misc::QFormat("{} \t\t[Delivered in {} us]",
-                                          widget->text().trimmed().toStdString(), duration.count()));
+            widget->setText(Misc::QFormat("{} \t\t[Delivered in {} us, acknowledged in {} us, round trip {} us]",
+                                          widget->text().trimmed().toStdString(), delivered.count(),
+                                          (roundTrip - delivered).count(), roundTrip.count()));
 
             // Remove the stored data as it's no longer necessary
             data_.erase(iter);
@@ -152,6 +245,34 @@ void AppWidget::Connected() {
         ui_->startBtn->setDisabled(true);
 }
 
+/**
+ * @return the processor configuration shared by both modes
+ */
+Chat::Processor::Options AppWidget::Options() {
+    Chat::Processor::Options options;
+
+    // Invoked on the processor's thread, forwarded to the UI thread through the signal
+    options.onBackpressure = [this](bool paused) {
+        emit Backpressure(paused);
+    };
+
+    // Every frame is recorded for ChatReplay when requested
+    if (char const* capture = std::getenv("CHATAPP_CAPTURE"))
+        options.capture = capture;
+
+    options.onTransfer = [this](Chat::TransferProgress const& progress) {
+        auto const percent = progress.size == 0 ? 100 : progress.bytes * 100 / progress.size;
+        auto const state = progress.failed ? std::string("failed") : fmt::format("{}%", percent);
+
+        emit Progress(progress.id, Misc::QFormat("[Transfer {}] {} #{}: {}{}", progress.outgoing ? "to" : "from",
+                                                 progress.name, progress.room, state,
+                                                 progress.done && !progress.outgoing && !progress.failed && !progress.path.empty()
+                                                     ? fmt::format(", saved to {}", progress.path.string()) : std::string()));
+    };
+
+    return options;
+}
+
 /**
  * @brief The callback is invoked when a client disconnects (server mode), or when we disconnect (client mode)
  */
@@ -18,6 +18,7 @@
 #include <variant>
 #include <utility>
 #include <memory>
+#include <unordered_map>
 
 namespace Ui {
     class AppWidget;
@@ -63,6 +64,29 @@ public:
      */
     Q_SIGNAL void NoHost();
 
+    /**
+     * @brief Invoked internally when the processor's outbound queues cross a watermark
+     * @attention This is not a normal function, it has no implementation, it's a Qt signal
+     * @param paused true if the connection to the server is congested and no more messages should be produced, false once it drained
+     */
+    Q_SIGNAL void Backpressure(bool paused);
+
+    /**
+     * @brief Invoked internally when a transfer made progress, in either direction
+     * @attention This is not a normal function, it has no implementation, it's a Qt signal
+     * @param id the identifier of the transfer
+     * @param text the text describing the progress
+     */
+    Q_SIGNAL void Progress(quint64 id, QString const& text);
+
+    /**
+     * @brief Invoked internally when the server confirmed or refused a room membership
+     * @attention This is not a normal function, it has no implementation, it's a Qt signal
+     * @param room the name of the room
+     * @param joined true if a join was confirmed, false if the server says that we aren't a member
+     */
+    Q_SIGNAL void Subscribed(QString const& room, bool joined);
+
 private:
     /**
      * @brief The callback is invoked when the processor receives a message
@@ -80,15 +104,23 @@ private:
      */
     void Disconnected();
 
+    /**
+     * @return the processor configuration shared by both modes
+     */
+    Chat::Processor::Options Options();
+
 private:
     Q_OBJECT
     Ui::AppWidget* ui_; /**< Qt doesn't handle RAII well with UI's.., this is an owning pointer */
     Chat::Mode mode_;
     std::unique_ptr<Chat::Processor> processor_;
+    std::string room_{Chat::DefaultRoom};   /**< The room new messages are published to */
 
     std::unordered_map<Chat::Message::HashType, std::pair<std::chrono::system_clock::time_point, QListWidgetItem*>> data_;
     /**< Contains a map of message hashes and their corresponding sent-time and the QListWidgetItem that is displayed on the chatbox
      * so we can update the contents to show the response time */
+
+    std::unordered_map<std::uint64_t, QListWidgetItem*> transfers_;  /**< The chatbox item showing the progress of every transfer */
 };
 
 #endif // CHATAPP_APPWIDGET_HPP
\ No newline at end of file